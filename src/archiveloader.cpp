@@ -0,0 +1,140 @@
+#include "archiveloader.h"
+
+#include <algorithm>
+#include <iterator>
+#include <numeric>
+
+#include <glog/logging.h>
+
+#include "util.h"
+
+
+ArchiveLoader::ArchiveLoader(const std::string& path, bool auto_version) :
+        path_(path),
+        auto_version_(auto_version) {
+    if (auto_version_ && !path_.empty() && path_.back() != '/') {
+        path_.append("/");
+    }
+    if (!auto_version_ && !GetArchive("")) {
+        LOG(ERROR) << "Tile archive " << path_ << " can not be opened";
+    }
+}
+
+std::shared_ptr<const TileArchive> ArchiveLoader::GetArchive(const std::string& version) const {
+    // Mapped archive is checked to be the current file at most this often
+    static const auto kArchiveCheckInterval = std::chrono::seconds(1);
+    // Missing archive is looked up again after this time, the version could be packed meanwhile
+    static const auto kMissingArchiveTtl = std::chrono::seconds(5);
+    static const std::size_t kMaxMissingArchives = 1024;
+
+    const std::string& archive_version = auto_version_ ? version : "";
+    const std::string archive_path = auto_version_ ? path_ + version + ".tiles" : path_;
+    const auto now = clock_t::now();
+    // Replaced archive is unmapped outside of the lock, unless tiles still refer to it
+    std::shared_ptr<const TileArchive> replaced_archive;
+    std::shared_ptr<const TileArchive> archive;
+    {
+        std::lock_guard<std::mutex> lock(archives_mux_);
+        auto archive_itr = archives_.find(archive_version);
+        if (archive_itr != archives_.end()) {
+            MappedArchive& mapped = archive_itr->second;
+            if (now - mapped.check_time < kArchiveCheckInterval) {
+                return mapped.archive;
+            }
+            mapped.check_time = now;
+            if (!mapped.archive->Replaced(archive_path)) {
+                return mapped.archive;
+            }
+            replaced_archive = std::move(mapped.archive);
+            archives_.erase(archive_itr);
+        } else {
+            auto missing_itr = missing_archives_.find(archive_version);
+            if (missing_itr != missing_archives_.end() && now < missing_itr->second) {
+                return nullptr;
+            }
+        }
+        archive = TileArchive::Open(archive_path);
+        if (!archive) {
+            if (missing_archives_.size() >= kMaxMissingArchives) {
+                for (auto itr = missing_archives_.begin(); itr != missing_archives_.end();) {
+                    itr = now < itr->second ? std::next(itr) : missing_archives_.erase(itr);
+                }
+            }
+            missing_archives_[archive_version] = now + kMissingArchiveTtl;
+            return nullptr;
+        }
+        missing_archives_.erase(archive_version);
+        archives_[archive_version] = MappedArchive{archive, now};
+    }
+    // Version is published or its archive is replaced
+    NotifyReload(archive_version);
+    return archive;
+}
+
+// Returns false and sets error if the archive has no valid tile
+static bool ReadTile(const std::shared_ptr<const TileArchive>& archive, const TileId& tile_id, Tile& tile,
+                     LoadError& error) {
+    std::experimental::string_view blob;
+    if (!archive->Find(tile_id, blob)) {
+        error = LoadError::not_found;
+        return false;
+    }
+    std::experimental::string_view uncomp;
+    try {
+        uncomp = util::decompress(blob.data(), blob.size());
+    } catch (const std::exception& e) {
+        LOG(ERROR) << "Unable to decompress tile: " << e.what() << " " << tile_id;
+        error = LoadError::internal_error;
+        return false;
+    }
+    if (uncomp.data() == blob.data()) {
+        tile = Tile(tile_id, blob, archive);
+    } else {
+        tile = Tile(tile_id, std::make_shared<const std::string>(uncomp.data(), uncomp.size()));
+    }
+    return true;
+}
+
+void ArchiveLoader::Load(std::shared_ptr<LoadTask> task, const TileId& tile_id, const std::string& version) {
+    std::shared_ptr<const TileArchive> archive = GetArchive(version);
+    if (!archive) {
+        task->NotifyError(LoadError::internal_error);
+        return;
+    }
+    Tile tile;
+    LoadError error = LoadError::internal_error;
+    if (ReadTile(archive, tile_id, tile, error)) {
+        task->SetResult(std::move(tile));
+    } else {
+        task->NotifyError(error);
+    }
+}
+
+void ArchiveLoader::LoadMany(std::shared_ptr<LoadManyTask> task, const std::vector<TileId>& tile_ids,
+                             const std::string& version, LoadPriority priority) {
+    std::shared_ptr<const TileArchive> archive = GetArchive(version);
+    if (!archive) {
+        task->NotifyError(LoadError::internal_error);
+        return;
+    }
+    // Tiles are read in the archive order, so directory lookups and blobs stay close to each other
+    std::vector<std::size_t> order(tile_ids.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&tile_ids](std::size_t lhs, std::size_t rhs) {
+        return TileArchiveKey(tile_ids[lhs]) < TileArchiveKey(tile_ids[rhs]);
+    });
+    auto batch = std::make_shared<LoadBatch>(std::move(task), tile_ids);
+    for (std::size_t idx : order) {
+        Tile tile;
+        LoadError error = LoadError::internal_error;
+        if (ReadTile(archive, tile_ids[idx], tile, error)) {
+            batch->SetTile(idx, std::move(tile));
+        } else {
+            batch->SetError(idx, error);
+        }
+    }
+}
+
+bool ArchiveLoader::HasVersion(const std::string& version) const {
+    return !auto_version_ || GetArchive(version) != nullptr;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "tile_archive.h"
+#include "tile_loader.h"
+
+
+// Loads tiles from packed archives, see TileArchive. Uncompressed tiles are views into the mapped archive and
+// are not copied. With auto_version every version has its own archive <path>/<version>.tiles, otherwise path is
+// the archive itself. Archive replaced in place is mapped again, versions without an archive are looked up again
+// after a short time.
+class ArchiveLoader : public TileLoader {
+public:
+    ArchiveLoader(const std::string& path, bool auto_version = false);
+
+    void Load(std::shared_ptr<LoadTask> task, const TileId& tile_id, const std::string& version = "") override;
+
+    // Tiles of the batch are read at once from the mapped archive
+    void LoadMany(std::shared_ptr<LoadManyTask> task, const std::vector<TileId>& tile_ids,
+                  const std::string& version = "", LoadPriority priority = LoadPriority::interactive) override;
+
+    bool HasVersion(const std::string& version) const override;
+
+private:
+    using clock_t = std::chrono::steady_clock;
+
+    struct MappedArchive {
+        std::shared_ptr<const TileArchive> archive;
+        // Last time the file was checked to be the mapped one
+        clock_t::time_point check_time;
+    };
+
+    // Archives are mapped on first use. Returns nullptr if the archive can not be opened.
+    std::shared_ptr<const TileArchive> GetArchive(const std::string& version) const;
+
+    std::string path_;
+    bool auto_version_;
+    mutable std::unordered_map<std::string, MappedArchive> archives_;
+    // Versions without an archive and the time until which they are not looked up
+    mutable std::unordered_map<std::string, clock_t::time_point> missing_archives_;
+    mutable std::mutex archives_mux_;
+};
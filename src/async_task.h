@@ -31,6 +31,7 @@ public:
     virtual ~AsyncTaskBase() {}
 
     virtual bool cancel() = 0;
+    virtual bool cancelled() const noexcept = 0;
 };
 
 template <typename Res = void, typename Err = void>
@@ -78,7 +79,7 @@ public:
         return status_ != TaskStatus::pending;
     }
 
-    inline bool cancelled() const noexcept {
+    inline bool cancelled() const noexcept override {
         return status_ == TaskStatus::cancelled;
     }
 
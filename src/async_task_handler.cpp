@@ -9,3 +9,20 @@ AsyncTaskHandler::AsyncTaskHandler() {
 void AsyncTaskHandler::onTaskTimeotExpired() noexcept {
     SendError(500);
 }
+
+void AsyncTaskHandler::requestComplete() noexcept {
+    CancelPendingTask();
+    BaseHandler::requestComplete();
+}
+
+void AsyncTaskHandler::onError(proxygen::ProxygenError err) noexcept {
+    CancelPendingTask();
+    BaseHandler::onError(err);
+}
+
+void AsyncTaskHandler::CancelPendingTask() noexcept {
+    if (pending_task_) {
+        pending_task_->cancel();
+        pending_task_.reset();
+    }
+}
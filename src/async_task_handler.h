@@ -13,6 +13,7 @@ public:
     void ScheduleTaskTimeout(std::shared_ptr<AsyncTask<T, U>> task, std::chrono::milliseconds timeout) {
         timeout_callback_.reset();
         assert(evb_->inRunningEventBaseThread());
+        pending_task_ = task;
         timeout_callback_ = std::make_unique<TimeoutCallback<T, U>>(*this, std::move(task));
         evb_->timer().scheduleTimeout(timeout_callback_.get(), timeout);
     }
@@ -22,6 +23,7 @@ public:
         assert(evb_->inRunningEventBaseThread());
         // Callback detaches from timer in it's destructor
         timeout_callback_.reset();
+        pending_task_.reset();
     }
 
     void RunInHandlerThread(EventBase::Func f) {
@@ -31,6 +33,10 @@ public:
     // If this callback is called task callbacks are guaranteed not to be called
     virtual void onTaskTimeotExpired() noexcept;
 
+    // Pending task is cancelled if the client has gone, so its queued work is not processed
+    void requestComplete() noexcept override;
+    void onError(proxygen::ProxygenError err) noexcept override;
+
 private:
     using HHWheelTimer = folly::HHWheelTimer;
 
@@ -56,6 +62,9 @@ private:
         AsyncTaskHandler& handler_;
     };
 
+    void CancelPendingTask() noexcept;
+
     std::unique_ptr<HHWheelTimer::Callback> timeout_callback_;
+    std::shared_ptr<AsyncTaskBase> pending_task_;
     EventBase* evb_;
 };
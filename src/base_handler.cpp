@@ -29,6 +29,15 @@ void BaseHandler::SendError(uint16_t err_code) {
     OnErrorSent(err_code);
 }
 
+void BaseHandler::SendError(std::uint16_t err_code, std::chrono::seconds retry_after) {
+    error_sent_ = true;
+    proxygen::ResponseBuilder(downstream_)
+            .status(err_code, util::http_status_msg(err_code))
+            .header("Retry-After", std::to_string(retry_after.count()))
+            .sendWithEOM();
+    OnErrorSent(err_code);
+}
+
 void BaseHandler::OnErrorSent(std::uint16_t err_code) noexcept {}
 
 void BaseHandler::onUpgrade(proxygen::UpgradeProtocol proto) noexcept {
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <chrono>
+
 #include <proxygen/httpserver/RequestHandler.h>
 
 class BaseHandler : public proxygen::RequestHandler {
@@ -21,6 +23,8 @@ protected:
     virtual void OnErrorSent(std::uint16_t err_code) noexcept;
 
     void SendError(std::uint16_t err_code);
+    // Tells the client when to repeat the request, e.g. for 503
+    void SendError(std::uint16_t err_code, std::chrono::seconds retry_after);
 
 private:
     bool error_sent_{false};
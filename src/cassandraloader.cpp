@@ -1,16 +1,114 @@
 #include "cassandraloader.h"
 
+#include <map>
 #include <sstream>
+#include <string>
 #include <thread>
+#include <unordered_map>
 
 #include <glog/logging.h>
 
 #include "util.h"
 
+// Tiles are partitioned by zoom and block of the index
+static const int kTilesPerBlock = 32768;
+
+static bool ParseConsistency(const std::string& name, CassConsistency& consistency) {
+    static const std::unordered_map<std::string, CassConsistency> kConsistencies = {
+        {"any", CASS_CONSISTENCY_ANY},
+        {"one", CASS_CONSISTENCY_ONE},
+        {"two", CASS_CONSISTENCY_TWO},
+        {"three", CASS_CONSISTENCY_THREE},
+        {"quorum", CASS_CONSISTENCY_QUORUM},
+        {"all", CASS_CONSISTENCY_ALL},
+        {"local_quorum", CASS_CONSISTENCY_LOCAL_QUORUM},
+        {"each_quorum", CASS_CONSISTENCY_EACH_QUORUM},
+        {"local_one", CASS_CONSISTENCY_LOCAL_ONE}
+    };
+    auto consistency_itr = kConsistencies.find(name);
+    if (consistency_itr == kConsistencies.end()) {
+        return false;
+    }
+    consistency = consistency_itr->second;
+    return true;
+}
+
+// Column types of the table are not known in advance
+static CassError BindInteger(CassStatement* statement, const CassPrepared* prepared, std::size_t index, int value) {
+    const CassDataType* data_type = cass_prepared_parameter_data_type(prepared, index);
+    switch (data_type ? cass_data_type_type(data_type) : CASS_VALUE_TYPE_INT) {
+    case CASS_VALUE_TYPE_BIGINT:
+        return cass_statement_bind_int64(statement, index, value);
+    case CASS_VALUE_TYPE_SMALLINT:
+        return cass_statement_bind_int16(statement, index, static_cast<cass_int16_t>(value));
+    default:
+        return cass_statement_bind_int32(statement, index, value);
+    }
+}
+
+static CassError BindIntegerList(CassStatement* statement, const CassPrepared* prepared, std::size_t index,
+                                 const std::vector<int>& values) {
+    const CassDataType* data_type = cass_prepared_parameter_data_type(prepared, index);
+    const CassDataType* value_type = data_type ? cass_data_type_sub_data_type(data_type, 0) : nullptr;
+    const CassValueType type = value_type ? cass_data_type_type(value_type) : CASS_VALUE_TYPE_INT;
+    CassCollection* collection = cass_collection_new(CASS_COLLECTION_TYPE_LIST, values.size());
+    CassError error = CASS_OK;
+    for (auto value_itr = values.begin(); error == CASS_OK && value_itr != values.end(); ++value_itr) {
+        switch (type) {
+        case CASS_VALUE_TYPE_BIGINT:
+            error = cass_collection_append_int64(collection, *value_itr);
+            break;
+        case CASS_VALUE_TYPE_SMALLINT:
+            error = cass_collection_append_int16(collection, static_cast<cass_int16_t>(*value_itr));
+            break;
+        default:
+            error = cass_collection_append_int32(collection, *value_itr);
+        }
+    }
+    if (error == CASS_OK) {
+        error = cass_statement_bind_collection(statement, index, collection);
+    }
+    cass_collection_free(collection);
+    return error;
+}
+
+static bool GetInteger(const CassValue* value, int& result) {
+    if (!value) {
+        return false;
+    }
+    switch (cass_value_type(value)) {
+    case CASS_VALUE_TYPE_BIGINT: {
+        cass_int64_t int64_value;
+        if (cass_value_get_int64(value, &int64_value) != CASS_OK) {
+            return false;
+        }
+        result = static_cast<int>(int64_value);
+        return true;
+    }
+    case CASS_VALUE_TYPE_SMALLINT: {
+        cass_int16_t int16_value;
+        if (cass_value_get_int16(value, &int16_value) != CASS_OK) {
+            return false;
+        }
+        result = int16_value;
+        return true;
+    }
+    default: {
+        cass_int32_t int32_value;
+        if (cass_value_get_int32(value, &int32_value) != CASS_OK) {
+            return false;
+        }
+        result = int32_value;
+        return true;
+    }
+    }
+}
+
 CassandraLoader::CassandraLoader(const std::string& contact_points,
                                  const std::string& keyspace,
                                  const std::string& table,
-                                 uint workers) :
+                                 uint workers,
+                                 const std::string& consistency) :
         keyspace_(keyspace),
         table_(table)
 {
@@ -21,6 +119,16 @@ CassandraLoader::CassandraLoader(const std::string& contact_points,
     session_ = cass_session_new();
     cass_cluster_set_num_threads_io(cluster_, workers);
     cass_cluster_set_contact_points(cluster_, contact_points.c_str());
+    // Prepared statements carry routing keys, so queries go straight to a replica
+    cass_cluster_set_token_aware_routing(cluster_, cass_true);
+    if (!consistency.empty()) {
+        CassConsistency cass_consistency;
+        if (ParseConsistency(consistency, cass_consistency)) {
+            cass_cluster_set_consistency(cluster_, cass_consistency);
+        } else {
+            LOG(ERROR) << "Invalid consistency level: " << consistency;
+        }
+    }
     connect_thread_ = std::make_unique<std::thread>([&]{
         CassFuture* connect_future = nullptr;
         while (!connected_) {
@@ -49,6 +157,13 @@ CassandraLoader::~CassandraLoader() {
     CassFuture* close_future = cass_session_close(session_);
     cass_future_wait(close_future);
     cass_future_free(close_future);
+    for (auto& queries : prepared_queries_) {
+        for (auto& query : queries) {
+            if (query.second.prepared) {
+                cass_prepared_free(query.second.prepared);
+            }
+        }
+    }
     cass_cluster_free(cluster_);
     cass_session_free(session_);
 }
@@ -58,6 +173,39 @@ struct TaskWrapper {
     TileId tile_id;
 };
 
+struct BlockTile {
+    std::size_t batch_idx;
+    TileId tile_id;
+    int idx;
+    bool done;
+};
+
+struct BlockWrapper {
+    std::shared_ptr<LoadBatch> batch;
+    std::vector<BlockTile> tiles;
+};
+
+struct PrepareWrapper {
+    CassandraLoader* loader;
+    std::string keyspace;
+    int query_type;
+};
+
+// Returns nullptr if the tile can not be decompressed
+static std::shared_ptr<const std::string> GetTileBuffer(const CassRow* row, const TileId& tile_id) {
+    const CassValue* value = cass_row_get_column_by_name(row, "tile");
+    const char* tile_data;
+    size_t tile_data_length;
+    cass_value_get_string(value, &tile_data, &tile_data_length);
+    // Driver buffer is freed with the result, so the tile gets the only copy
+    try {
+        return util::decompress_shared(tile_data, tile_data_length);
+    } catch (const std::exception& e) {
+        LOG(ERROR) << "Unable to decompress tile: " << e.what() << " " << tile_id;
+    }
+    return nullptr;
+}
+
 static void ResultCallback(CassFuture* future, void* data) {
     TaskWrapper* task_wrapper = static_cast<TaskWrapper*>(data);
     CassError result_error = cass_future_error_code(future);
@@ -66,16 +214,13 @@ static void ResultCallback(CassFuture* future, void* data) {
         const CassResult* result = cass_future_get_result(future);
         CassIterator* rows = cass_iterator_from_result(result);
         if (cass_iterator_next(rows)) {
-            const CassRow* row = cass_iterator_get_row(rows);
-            const CassValue* value = cass_row_get_column_by_name(row, "tile");
-            const char* tile_data;
-            size_t tile_data_length;
-            cass_value_get_string(value, &tile_data, &tile_data_length);
-            std::string result_data;
-            // TODO: eleminate copying
-            util::decompress(tile_data, tile_data_length, result_data);
-            Tile result_tile{task_wrapper->tile_id, std::move(result_data)};
-            task_wrapper->task->SetResult(std::move(result_tile));
+            std::shared_ptr<const std::string> buffer = GetTileBuffer(cass_iterator_get_row(rows),
+                                                                      task_wrapper->tile_id);
+            if (buffer) {
+                task_wrapper->task->SetResult(Tile(task_wrapper->tile_id, std::move(buffer)));
+            } else {
+                task_wrapper->task->NotifyError(LoadError::internal_error);
+            }
         } else {
             task_wrapper->task->NotifyError(LoadError::not_found);
         }
@@ -97,6 +242,52 @@ static void ResultCallback(CassFuture* future, void* data) {
     delete task_wrapper;
 }
 
+static void BlockResultCallback(CassFuture* future, void* data) {
+    BlockWrapper* block_wrapper = static_cast<BlockWrapper*>(data);
+    LoadBatch& batch = *block_wrapper->batch;
+    if (cass_future_error_code(future) == CASS_OK) {
+        const CassResult* result = cass_future_get_result(future);
+        CassIterator* rows = cass_iterator_from_result(result);
+        while (cass_iterator_next(rows)) {
+            const CassRow* row = cass_iterator_get_row(rows);
+            int idx;
+            if (!GetInteger(cass_row_get_column_by_name(row, "idx"), idx)) {
+                continue;
+            }
+            for (BlockTile& tile : block_wrapper->tiles) {
+                if (tile.done || tile.idx != idx) {
+                    continue;
+                }
+                tile.done = true;
+                std::shared_ptr<const std::string> buffer = GetTileBuffer(row, tile.tile_id);
+                if (buffer) {
+                    batch.SetTile(tile.batch_idx, Tile(tile.tile_id, std::move(buffer)));
+                } else {
+                    batch.SetError(tile.batch_idx, LoadError::internal_error);
+                }
+            }
+        }
+        cass_iterator_free(rows);
+        cass_result_free(result);
+        // Tiles without a row do not exist
+        for (BlockTile& tile : block_wrapper->tiles) {
+            if (!tile.done) {
+                batch.SetError(tile.batch_idx, LoadError::not_found);
+            }
+        }
+    } else {
+        const char* message;
+        size_t message_length;
+        cass_future_error_message(future, &message, &message_length);
+        LOG(ERROR) << std::string(message, message_length);
+        for (BlockTile& tile : block_wrapper->tiles) {
+            batch.SetError(tile.batch_idx, LoadError::internal_error);
+        }
+    }
+    cass_future_free(future);
+    delete block_wrapper;
+}
+
 void CassandraLoader::Load(std::shared_ptr<LoadTask> task, const TileId& tile_id,
                            const std::string& version) {
     if (!connected_) {
@@ -108,13 +299,134 @@ void CassandraLoader::Load(std::shared_ptr<LoadTask> task, const TileId& tile_id
         task->NotifyError(LoadError::internal_error);
         return;
     }
-    int idx = xy_to_index(tile_id.x, tile_id.y);
-    int block = idx / 32768;
+    WithPrepared(keyspace, QueryType::tile, [this, task, tile_id](const CassPrepared* prepared) {
+        if (prepared) {
+            Execute(prepared, task, tile_id);
+        } else {
+            task->NotifyError(LoadError::internal_error);
+        }
+    });
+}
+
+void CassandraLoader::LoadMany(std::shared_ptr<LoadManyTask> task, const std::vector<TileId>& tile_ids,
+                               const std::string& version, LoadPriority priority) {
+    if (!connected_) {
+        task->NotifyError(LoadError::internal_error);
+        return;
+    }
+    const std::string& keyspace = auto_keyspace_ ? version : keyspace_;
+    if (!auto_keyspace_ && keyspace.empty()) {
+        task->NotifyError(LoadError::internal_error);
+        return;
+    }
+    auto batch = std::make_shared<LoadBatch>(std::move(task), tile_ids);
+    WithPrepared(keyspace, QueryType::block, [this, batch, tile_ids, version](const CassPrepared* prepared) {
+        if (!prepared) {
+            // Executes of the batch are pipelined over the session
+            for (std::size_t i = 0; i < tile_ids.size(); ++i) {
+                Load(batch->MakeTileTask(i), tile_ids[i], version);
+            }
+            return;
+        }
+        std::map<std::pair<uint, int>, std::vector<std::size_t>> blocks;
+        for (std::size_t i = 0; i < tile_ids.size(); ++i) {
+            const TileId& tile_id = tile_ids[i];
+            blocks[std::make_pair(tile_id.z, xy_to_index(tile_id.x, tile_id.y) / kTilesPerBlock)].push_back(i);
+        }
+        for (const auto& block : blocks) {
+            ExecuteBlock(prepared, batch, tile_ids, block.second);
+        }
+    });
+}
+
+void CassandraLoader::WithPrepared(const std::string& keyspace, QueryType query_type, prepared_cb_t cb) {
+    const CassPrepared* prepared = nullptr;
+    bool ready = false;
+    {
+        std::lock_guard<std::mutex> lock(prepared_mux_);
+        PreparedQuery& query = prepared_queries_[static_cast<std::size_t>(query_type)][keyspace];
+        if (query.prepared || query.unsupported) {
+            prepared = query.prepared;
+            ready = true;
+        } else {
+            query.pending.push_back(std::move(cb));
+            if (query.pending.size() > 1) {
+                return;
+            }
+        }
+    }
+    if (ready) {
+        cb(prepared);
+        return;
+    }
     std::stringstream cql_statment;
-    cql_statment << "SELECT tile FROM " << keyspace << "." << table_
-            << " WHERE idx=" << idx << " AND zoom=" << tile_id.z << " AND  block=" << block << ";";
-    CassStatement* statement
-      = cass_statement_new(cql_statment.str().c_str(), 0);
+    if (query_type == QueryType::tile) {
+        cql_statment << "SELECT tile FROM " << keyspace << "." << table_ << " WHERE idx=? AND zoom=? AND block=?;";
+    } else {
+        cql_statment << "SELECT idx, tile FROM " << keyspace << "." << table_
+                     << " WHERE zoom=? AND block=? AND idx IN ?;";
+    }
+    CassFuture* prepare_future = cass_session_prepare(session_, cql_statment.str().c_str());
+    PrepareWrapper* prepare_wrapper = new PrepareWrapper{this, keyspace, static_cast<int>(query_type)};
+    cass_future_set_callback(prepare_future, &CassandraLoader::PrepareCallback, static_cast<void*>(prepare_wrapper));
+}
+
+void CassandraLoader::PrepareCallback(CassFuture* future, void* data) {
+    PrepareWrapper* prepare_wrapper = static_cast<PrepareWrapper*>(data);
+    const CassPrepared* prepared = nullptr;
+    const CassError error = cass_future_error_code(future);
+    if (error == CASS_OK) {
+        prepared = cass_future_get_prepared(future);
+    } else {
+        const char* message;
+        size_t message_length;
+        cass_future_error_message(future, &message, &message_length);
+        LOG(ERROR) << "Unable to prepare statement for keyspace " << prepare_wrapper->keyspace << ": "
+                   << std::string(message, message_length);
+    }
+    prepare_wrapper->loader->OnPrepared(prepare_wrapper->keyspace, static_cast<QueryType>(prepare_wrapper->query_type),
+                                        prepared, error);
+    cass_future_free(future);
+    delete prepare_wrapper;
+}
+
+void CassandraLoader::OnPrepared(const std::string& keyspace, QueryType query_type, const CassPrepared* prepared,
+                                 CassError error) {
+    std::vector<prepared_cb_t> pending;
+    {
+        std::lock_guard<std::mutex> lock(prepared_mux_);
+        auto& queries = prepared_queries_[static_cast<std::size_t>(query_type)];
+        auto query_itr = queries.find(keyspace);
+        assert(query_itr != queries.end());
+        pending = std::move(query_itr->second.pending);
+        if (prepared) {
+            query_itr->second.prepared = prepared;
+        } else if (query_type == QueryType::block && error == CASS_ERROR_SERVER_INVALID_QUERY &&
+                   TilePrepared(keyspace)) {
+            // Table exists, but idx is not its clustering column. Batches are loaded tile by tile.
+            query_itr->second.unsupported = true;
+        } else {
+            // Statement is prepared again on the next load
+            queries.erase(query_itr);
+        }
+    }
+    for (prepared_cb_t& cb : pending) {
+        cb(prepared);
+    }
+}
+
+void CassandraLoader::Execute(const CassPrepared* prepared, std::shared_ptr<LoadTask> task, const TileId& tile_id) {
+    int idx = xy_to_index(tile_id.x, tile_id.y);
+    int block = idx / kTilesPerBlock;
+    CassStatement* statement = cass_prepared_bind(prepared);
+    if (BindInteger(statement, prepared, 0, idx) != CASS_OK ||
+            BindInteger(statement, prepared, 1, static_cast<int>(tile_id.z)) != CASS_OK ||
+            BindInteger(statement, prepared, 2, block) != CASS_OK) {
+        LOG(ERROR) << "Unable to bind tile query parameters: " << tile_id;
+        cass_statement_free(statement);
+        task->NotifyError(LoadError::internal_error);
+        return;
+    }
 
     CassFuture* result_future = cass_session_execute(session_, statement);
     cass_statement_free(statement);
@@ -122,6 +434,36 @@ void CassandraLoader::Load(std::shared_ptr<LoadTask> task, const TileId& tile_id
     cass_future_set_callback(result_future, &ResultCallback, static_cast<void*>(task_wrapper));
 }
 
+void CassandraLoader::ExecuteBlock(const CassPrepared* prepared, std::shared_ptr<LoadBatch> batch,
+                                   const std::vector<TileId>& tile_ids, const std::vector<std::size_t>& batch_idxs) {
+    assert(!batch_idxs.empty());
+    auto block_wrapper = std::make_unique<BlockWrapper>();
+    std::vector<int> idxs;
+    for (std::size_t batch_idx : batch_idxs) {
+        const TileId& tile_id = tile_ids[batch_idx];
+        const int idx = xy_to_index(tile_id.x, tile_id.y);
+        block_wrapper->tiles.push_back(BlockTile{batch_idx, tile_id, idx, false});
+        idxs.push_back(idx);
+    }
+    const TileId& first_tile_id = tile_ids[batch_idxs.front()];
+    CassStatement* statement = cass_prepared_bind(prepared);
+    if (BindInteger(statement, prepared, 0, static_cast<int>(first_tile_id.z)) != CASS_OK ||
+            BindInteger(statement, prepared, 1, idxs.front() / kTilesPerBlock) != CASS_OK ||
+            BindIntegerList(statement, prepared, 2, idxs) != CASS_OK) {
+        LOG(ERROR) << "Unable to bind block query parameters: " << first_tile_id;
+        cass_statement_free(statement);
+        for (std::size_t batch_idx : batch_idxs) {
+            batch->SetError(batch_idx, LoadError::internal_error);
+        }
+        return;
+    }
+    block_wrapper->batch = std::move(batch);
+
+    CassFuture* result_future = cass_session_execute(session_, statement);
+    cass_statement_free(statement);
+    cass_future_set_callback(result_future, &BlockResultCallback, static_cast<void*>(block_wrapper.release()));
+}
+
 bool CassandraLoader::HasVersion(const std::string& version) const {
     // TODO: Implement
     return true;
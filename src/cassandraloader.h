@@ -1,6 +1,11 @@
 #pragma once
 
+#include <array>
+#include <functional>
+#include <mutex>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <cassandra.h>
 
@@ -8,10 +13,12 @@
 
 class CassandraLoader : public TileLoader {
 public:
+    // Consistency is one of the CQL consistency level names, e.g. "local_quorum". Driver default is used if empty.
     CassandraLoader(const std::string& contact_points,
                     const std::string& keyspace,
                     const std::string& table,
-                    uint workers);
+                    uint workers,
+                    const std::string& consistency = "");
 
     virtual ~CassandraLoader();
 
@@ -19,6 +26,11 @@ public:
     void Load(std::shared_ptr<LoadTask> task, const TileId& tile_id,
               const std::string& version = "") override;
 
+    // Tiles of the same block are selected with one IN query. Tables which do not allow it get pipelined
+    // single tile queries.
+    void LoadMany(std::shared_ptr<LoadManyTask> task, const std::vector<TileId>& tile_ids,
+                  const std::string& version = "", LoadPriority priority = LoadPriority::interactive) override;
+
     bool HasVersion(const std::string& version) const override;
 
     inline bool status() const {
@@ -26,8 +38,39 @@ public:
     }
 
 private:
+    // Called with nullptr if the statement can not be prepared
+    using prepared_cb_t = std::function<void(const CassPrepared*)>;
+
+    enum class QueryType : std::uint8_t {
+        tile,
+        block
+    };
+
+    // Select statement prepared for a keyspace. Loads wait until it is prepared.
+    struct PreparedQuery {
+        const CassPrepared* prepared{nullptr};
+        // Table does not allow the query, it is not prepared again
+        bool unsupported{false};
+        std::vector<prepared_cb_t> pending;
+    };
+
     static int xy_to_index(int x, int y);
 
+    void WithPrepared(const std::string& keyspace, QueryType query_type, prepared_cb_t cb);
+    static void PrepareCallback(CassFuture* future, void* data);
+    void OnPrepared(const std::string& keyspace, QueryType query_type, const CassPrepared* prepared,
+                    CassError error);
+    // Should be called under prepared_mux_
+    inline bool TilePrepared(const std::string& keyspace) const {
+        const auto& queries = prepared_queries_[static_cast<std::size_t>(QueryType::tile)];
+        auto query_itr = queries.find(keyspace);
+        return query_itr != queries.end() && query_itr->second.prepared;
+    }
+    void Execute(const CassPrepared* prepared, std::shared_ptr<LoadTask> task, const TileId& tile_id);
+    // Tiles with the batch indices belong to the same zoom and block
+    void ExecuteBlock(const CassPrepared* prepared, std::shared_ptr<LoadBatch> batch,
+                      const std::vector<TileId>& tile_ids, const std::vector<std::size_t>& batch_idxs);
+
     std::atomic_bool connected_{false};
 
     CassCluster* cluster_;
@@ -36,5 +79,9 @@ private:
     std::string keyspace_;
     std::string table_;
     std::unique_ptr<std::thread> connect_thread_;
+    // Keyspaces of auto keyspace loader are versions, so statements are prepared on first use. Indexed by
+    // QueryType.
+    std::array<std::unordered_map<std::string, PreparedQuery>, 2> prepared_queries_;
+    std::mutex prepared_mux_;
     bool auto_keyspace_{false};
 };
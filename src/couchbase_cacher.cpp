@@ -72,8 +72,8 @@ void CouchbaseCacher::Set(const std::string& key, std::shared_ptr<const CachedTi
         auto set_waiters_itr = set_waiters_.find(key);
         if (set_waiters_itr != set_waiters_.end()) {
             waiters_vec = std::move(set_waiters_itr->second);
+            set_waiters_.erase(set_waiters_itr);
         }
-        set_waiters_.erase(set_waiters_itr);
     }
     CBWorkTask cb_task{cached_tile, key, expire_time, CBWorkTask::Type::set};
     workers_pool_.PostTask(std::move(cb_task));
@@ -107,7 +107,7 @@ void CouchbaseCacher::Unlock(const std::vector<std::string>& keys) {
             std::lock_guard<std::mutex> lock(mux_);
             auto set_waiters_itr = set_waiters_.find(key);
             if (set_waiters_itr == set_waiters_.end()) {
-                return;
+                continue;
             }
             waiters = std::move(set_waiters_itr->second);
             set_waiters_.erase(set_waiters_itr);
@@ -4,9 +4,11 @@
 
 #include <glog/logging.h>
 
+#include "archiveloader.h"
 #include "cassandraloader.h"
 #include "data_provider.h"
 #include "fileloader.h"
+#include "mbtilesloader.h"
 
 DataManager::DataManager(Config& config) : config_(config) {
     std::shared_ptr<const Json::Value> jdata_ptr = config.GetValue("data");
@@ -19,6 +21,18 @@ DataManager::DataManager(Config& config) : config_(config) {
         return;
     }
 
+    // Decompressed tiles are cached unless max_mb is zero
+    const Json::Value& jcache = jdata["cache"];
+    uint max_cache_mb = 256;
+    uint num_cache_shards = 16;
+    if (jcache.isObject()) {
+        max_cache_mb = jcache.get("max_mb", max_cache_mb).asUInt();
+        num_cache_shards = jcache.get("shards", num_cache_shards).asUInt();
+    }
+    if (max_cache_mb) {
+        tile_cache_ = std::make_shared<DataTileCache>(std::size_t(max_cache_mb) << 20, num_cache_shards);
+    }
+
     const Json::Value& jloaders = jdata["loaders"];
     for (auto loader = jloaders.begin(); loader != jloaders.end(); ++loader) {
         const std::string loader_name = loader.key().asString();
@@ -28,6 +42,10 @@ DataManager::DataManager(Config& config) : config_(config) {
             AddCassandraLoader(loader_name, loader_params);
         } else if (loader_type == "file") {
             AddFileLoader(loader_name, loader_params);
+        } else if (loader_type == "archive") {
+            AddArchiveLoader(loader_name, loader_params);
+        } else if (loader_type == "mbtiles") {
+            AddMBTilesLoader(loader_name, loader_params);
         } else {
             LOG(ERROR) << "Invalid loader type: " << loader_type;
         }
@@ -53,6 +71,30 @@ static std::shared_ptr<DataProvider::zoom_groups_t> parse_zoom_groups(const Json
     return zoom_groups;
 }
 
+// Not found tiles are remembered unless ttl is zero, filters of existing tiles are loaded for listed versions
+static std::shared_ptr<MissingTileCache> parse_missing_tiles(const Json::Value& jprovider_params) {
+    const Json::Value& jmissing_tiles = jprovider_params["missing_tiles"];
+    uint ttl = 300;
+    uint max_tiles = 100000;
+    uint max_versions = 4;
+    MissingTileCache::filters_t filters;
+    if (jmissing_tiles.isObject()) {
+        ttl = jmissing_tiles.get("ttl", ttl).asUInt();
+        max_tiles = jmissing_tiles.get("max_tiles", max_tiles).asUInt();
+        max_versions = jmissing_tiles.get("versions", max_versions).asUInt();
+        const Json::Value& jfilters = jmissing_tiles["filters"];
+        for (auto jfilter = jfilters.begin(); jfilter != jfilters.end(); ++jfilter) {
+            if (auto filter = TileFilter::Load(jfilter->asString())) {
+                filters.emplace(jfilter.key().asString(), std::move(filter));
+            }
+        }
+    }
+    if (ttl == 0 && filters.empty()) {
+        return nullptr;
+    }
+    return std::make_shared<MissingTileCache>(std::chrono::seconds(ttl), max_tiles, std::move(filters), max_versions);
+}
+
 void DataManager::AddDataProvider(const std::string& provider_name, const Json::Value& jprovider_params) {
     if (providers_map_.find(provider_name) != providers_map_.end()) {
         LOG(ERROR) << "Duplicate provider name: " << provider_name;
@@ -79,8 +121,12 @@ void DataManager::AddDataProvider(const std::string& provider_name, const Json::
     std::shared_ptr<DataProvider::zoom_groups_t> zoom_groups = parse_zoom_groups(jprovider_params);
     uint max_zoom = jprovider_params.get("max zoom", 19).asUInt();
     uint min_zoom = zoom_groups == nullptr ? jprovider_params.get("min zoom", 0).asUInt() : *zoom_groups->rbegin();
+    // Base tiles around a loaded one are prefetched within the radius, zero disables prefetch
+    uint prefetch_radius = jprovider_params.get("prefetch_radius", 0).asUInt();
 
-    auto provider = std::make_shared<DataProvider>(std::move(loader), min_zoom, max_zoom, std::move(zoom_groups));
+    auto provider = std::make_shared<DataProvider>(std::move(loader), min_zoom, max_zoom, std::move(zoom_groups),
+                                                   tile_cache_, loader_name, parse_missing_tiles(jprovider_params),
+                                                   prefetch_radius);
     providers_map_.emplace(provider_name, std::move(provider));
 }
 
@@ -107,7 +153,10 @@ void DataManager::AddCassandraLoader(const std::string &loader_name, const Json:
         return;
     }
 
-    auto cassandra_loader = std::make_shared<CassandraLoader>(contact_points, keyspace, table, nworkers);
+    const std::string consistency = jloader_params.get("consistency", "").asString();
+
+    auto cassandra_loader = std::make_shared<CassandraLoader>(contact_points, keyspace, table, nworkers,
+                                                              consistency);
     loaders_map_[loader_name] = std::move(cassandra_loader);
 }
 
@@ -120,10 +169,64 @@ void DataManager::AddFileLoader(const std::string& loader_name, const Json::Valu
 
     const std::string base_path = jloader_params.get("base_path", "").asString();
     bool auto_version = jloader_params.get("auto_version", false).asBool();
-    auto file_loader = std::make_shared<FileLoader>(base_path, auto_version);
+    // Files are read by own threads, so slow disks do not block event loops
+    uint num_workers = jloader_params.get("workers", 4).asUInt();
+    uint queue_depth = jloader_params.get("queue_depth", 1000).asUInt();
+    auto file_loader = std::make_shared<FileLoader>(base_path, auto_version, num_workers, queue_depth);
     loaders_map_[loader_name] = std::move(file_loader);
 }
 
+void DataManager::AddArchiveLoader(const std::string& loader_name, const Json::Value& jloader_params) {
+    if (loaders_map_.find(loader_name) != loaders_map_.end()) {
+        LOG(ERROR) << "Duplicate loader name: " << loader_name;
+        return;
+    }
+
+    const std::string path = jloader_params.get("path", "").asString();
+    if (path.empty()) {
+        LOG(ERROR) << "No path for loader " << loader_name << " provided. Skipping!";
+        return;
+    }
+    bool auto_version = jloader_params.get("auto_version", false).asBool();
+    loaders_map_[loader_name] = std::make_shared<ArchiveLoader>(path, auto_version);
+}
+
+void DataManager::AddMBTilesLoader(const std::string& loader_name, const Json::Value& jloader_params) {
+    if (loaders_map_.find(loader_name) != loaders_map_.end()) {
+        LOG(ERROR) << "Duplicate loader name: " << loader_name;
+        return;
+    }
+
+    // Versions are either listed explicitly or are files in the path directory
+    std::unordered_map<std::string, std::string> versions;
+    const Json::Value& jversions = jloader_params["versions"];
+    for (auto jversion = jversions.begin(); jversion != jversions.end(); ++jversion) {
+        if (!jversion->isString()) {
+            LOG(ERROR) << "Invalid file of version " << jversion.key().asString() << " in loader " << loader_name;
+            continue;
+        }
+        versions.emplace(jversion.key().asString(), jversion->asString());
+    }
+    const std::string path = jloader_params.get("path", "").asString();
+    if (path.empty() && versions.empty()) {
+        LOG(ERROR) << "No path for loader " << loader_name << " provided. Skipping!";
+        return;
+    }
+    bool auto_version = jloader_params.get("auto_version", false).asBool();
+    uint num_workers = jloader_params.get("workers", 4).asUInt();
+    uint queue_depth = jloader_params.get("queue_depth", 1000).asUInt();
+    std::size_t mmap_size = std::size_t(jloader_params.get("mmap_mb", 256).asUInt()) << 20;
+    loaders_map_[loader_name] = std::make_shared<MBTilesLoader>(path, auto_version, std::move(versions), num_workers,
+                                                                queue_depth, mmap_size);
+}
+
+DataTileCache::Stats DataManager::tile_cache_stats() const {
+    if (!tile_cache_) {
+        return DataTileCache::Stats{0, 0, 0, 0};
+    }
+    return tile_cache_->stats();
+}
+
 std::shared_ptr<DataProvider> DataManager::GetProvider(const std::string& name) {
     auto provider_itr = providers_map_.find(name);
     if (provider_itr == providers_map_.end()) {
@@ -131,3 +234,11 @@ std::shared_ptr<DataProvider> DataManager::GetProvider(const std::string& name)
     }
     return provider_itr->second;
 }
+
+void DataManager::AddReloadCallback(reload_cb_t cb) {
+    for (auto& provider : providers_map_) {
+        provider.second->AddReloadCallback([cb, provider_name = provider.first](const std::string& version) {
+            cb(provider_name, version);
+        });
+    }
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <functional>
 #include <unordered_map>
 
 #include <jsoncpp/json/json.h>
@@ -12,6 +13,8 @@ class DataManager {
 public:
     using success_cb_t = LoadTask::result_cb_t;
     using error_cb_t = LoadTask::error_cb_t;
+    // Empty version means every version of the provider
+    using reload_cb_t = std::function<void(const std::string& provider_name, const std::string& version)>;
 
     DataManager(Config& config);
 
@@ -20,6 +23,12 @@ public:
 
     std::shared_ptr<DataProvider> GetProvider(const std::string& name);
 
+    // Callback is called when data of a provider is reloaded. Should be called before tiles are loaded.
+    void AddReloadCallback(reload_cb_t cb);
+
+    // All zeros if data tiles are not cached
+    DataTileCache::Stats tile_cache_stats() const;
+
 private:
     using loaders_map_t = std::unordered_map<std::string, std::shared_ptr<TileLoader>>;
     using providers_map_t = std::unordered_map<std::string, std::shared_ptr<DataProvider>>;
@@ -27,8 +36,12 @@ private:
     void AddDataProvider(const std::string& provider_name, const Json::Value& jprovider_params);
     void AddCassandraLoader(const std::string& loader_name, const Json::Value& jloader_params);
     void AddFileLoader(const std::string& loader_name, const Json::Value& jloader_params);
+    void AddArchiveLoader(const std::string& loader_name, const Json::Value& jloader_params);
+    void AddMBTilesLoader(const std::string& loader_name, const Json::Value& jloader_params);
 
     loaders_map_t loaders_map_;
     providers_map_t providers_map_;
+    // Shared by all providers
+    std::shared_ptr<DataTileCache> tile_cache_;
     Config& config_;
 };
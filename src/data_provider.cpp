@@ -5,12 +5,34 @@ using std::experimental::optional;
 using std::experimental::nullopt;
 
 DataProvider::DataProvider(std::shared_ptr<TileLoader> loader, uint min_zoom, uint max_zoom,
-                           std::shared_ptr<zoom_groups_t> zoom_groups) :
+                           std::shared_ptr<zoom_groups_t> zoom_groups,
+                           std::shared_ptr<DataTileCache> cache, const std::string& loader_name,
+                           std::shared_ptr<MissingTileCache> missing_tiles, uint prefetch_radius) :
         loader_(std::move(loader)),
         zoom_groups_(std::move(zoom_groups)),
+        cache_(std::move(cache)),
+        loader_name_(loader_name),
+        missing_tiles_(std::move(missing_tiles)),
         min_zoom_(min_zoom),
-        max_zoom_(max_zoom) {
+        max_zoom_(max_zoom),
+        prefetch_radius_(prefetch_radius) {
     assert(loader_);
+    if (missing_tiles_) {
+        // Tiles not found before the reload could exist now
+        loader_->AddReloadCallback([missing_tiles = missing_tiles_](const std::string& version) {
+            if (version.empty()) {
+                missing_tiles->InvalidateAll();
+            } else {
+                missing_tiles->Invalidate(version);
+            }
+        });
+    }
+    if (cache_) {
+        // Cached tiles could have been changed by the reload
+        loader_->AddReloadCallback([cache = cache_, loader_name = loader_name_](const std::string& version) {
+            cache->Invalidate(loader_name, version);
+        });
+    }
 }
 
 std::shared_ptr<LoadTask> DataProvider::GetTile(success_cb_t success_cb, error_cb_t error_cb,
@@ -30,7 +52,134 @@ void DataProvider::GetTile(std::shared_ptr<LoadTask> task, const TileId& tile_id
         task->NotifyError(LoadError::not_found);
         return;
     }
-    loader_->Load(std::move(task), *base_tile, version);
+    if (missing_tiles_ && missing_tiles_->IsMissing(version, *base_tile)) {
+        task->NotifyError(LoadError::not_found);
+        return;
+    }
+    // Tiles of a zoom group share the base tile
+    std::string key = DataTileCache::MakeKey(loader_name_, version, *base_tile);
+    if (cache_) {
+        if (std::shared_ptr<const Tile> cached_tile = cache_->Get(key)) {
+            task->SetResult(Tile(*cached_tile));
+            return;
+        }
+    }
+    if (!JoinLoad(key, std::move(task))) {
+        return;
+    }
+    // Provider is kept alive until the loader finishes
+    auto self = shared_from_this();
+    auto load_task = std::make_shared<LoadTask>([self, key](Tile&& tile) {
+        self->FinishLoad(key, std::move(tile));
+    }, [self, key, version, base_tile_id = *base_tile](LoadError error) {
+        self->FailLoad(key, version, base_tile_id, error);
+    });
+    loader_->Load(std::move(load_task), *base_tile, version);
+    if (prefetch_radius_) {
+        Prefetch(*base_tile, version);
+    }
+}
+
+void DataProvider::Prefetch(const TileId& base_tile_id, const std::string& version) {
+    const int radius = static_cast<int>(prefetch_radius_);
+    const std::int64_t max_coord = (std::int64_t(1) << base_tile_id.z) - 1;
+    std::vector<TileId> tile_ids;
+    std::vector<std::string> keys;
+    for (int dy = -radius; dy <= radius; ++dy) {
+        for (int dx = -radius; dx <= radius; ++dx) {
+            const std::int64_t x = std::int64_t(base_tile_id.x) + dx;
+            const std::int64_t y = std::int64_t(base_tile_id.y) + dy;
+            if ((dx == 0 && dy == 0) || x < 0 || y < 0 || x > max_coord || y > max_coord) {
+                continue;
+            }
+            const TileId tile_id{static_cast<uint>(x), static_cast<uint>(y), base_tile_id.z};
+            if (missing_tiles_ && missing_tiles_->IsMissing(version, tile_id)) {
+                continue;
+            }
+            std::string key = DataTileCache::MakeKey(loader_name_, version, tile_id);
+            if ((cache_ && cache_->Get(key)) || !JoinLoad(key, nullptr)) {
+                continue;
+            }
+            tile_ids.push_back(tile_id);
+            keys.push_back(std::move(key));
+        }
+    }
+    if (tile_ids.empty()) {
+        return;
+    }
+    // Tiles requested meanwhile join the loads of the batch
+    auto self = shared_from_this();
+    auto batch_task = std::make_shared<LoadManyTask>([self, keys, version](std::vector<BatchTile>&& tiles) {
+        for (std::size_t i = 0; i < tiles.size(); ++i) {
+            if (tiles[i].loaded) {
+                self->FinishLoad(keys[i], std::move(tiles[i].tile));
+            } else {
+                self->FailLoad(keys[i], version, tiles[i].tile.id, tiles[i].error);
+            }
+        }
+    }, [self, keys, tile_ids, version](LoadError error) {
+        for (std::size_t i = 0; i < keys.size(); ++i) {
+            self->FailLoad(keys[i], version, tile_ids[i], error);
+        }
+    });
+    loader_->LoadMany(std::move(batch_task), tile_ids, version, LoadPriority::background);
+}
+
+bool DataProvider::JoinLoad(const std::string& key, std::shared_ptr<LoadTask> task) {
+    // Lost loads are never finished, so stale entries are replaced
+    static const auto kInflightLoadTimeout = std::chrono::seconds(30);
+
+    const auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(inflight_mux_);
+    auto inflight_itr = inflight_loads_.find(key);
+    if (inflight_itr != inflight_loads_.end() && now - inflight_itr->second.start_time < kInflightLoadTimeout) {
+        if (task) {
+            inflight_itr->second.waiters.push_back(std::move(task));
+        }
+        return false;
+    }
+    InflightLoad& inflight = inflight_loads_[key];
+    inflight.start_time = now;
+    inflight.waiters.clear();
+    if (task) {
+        inflight.waiters.push_back(std::move(task));
+    }
+    return true;
+}
+
+std::vector<std::shared_ptr<LoadTask>> DataProvider::TakeWaiters(const std::string& key) {
+    std::vector<std::shared_ptr<LoadTask>> waiters;
+    std::lock_guard<std::mutex> lock(inflight_mux_);
+    auto inflight_itr = inflight_loads_.find(key);
+    if (inflight_itr != inflight_loads_.end()) {
+        waiters = std::move(inflight_itr->second.waiters);
+        inflight_loads_.erase(inflight_itr);
+    }
+    return waiters;
+}
+
+void DataProvider::FinishLoad(const std::string& key, Tile&& tile) {
+    // Cache and waiters share the tile bytes
+    tile.Share();
+    // Mapped tiles are found again as fast as in the cache, and they would keep replaced files mapped
+    if (cache_ && !tile.mapped) {
+        cache_->Put(key, std::make_shared<const Tile>(tile));
+    }
+    for (auto& waiter : TakeWaiters(key)) {
+        if (!waiter->cancelled()) {
+            waiter->SetResult(Tile(tile));
+        }
+    }
+}
+
+void DataProvider::FailLoad(const std::string& key, const std::string& version, const TileId& tile_id,
+                            LoadError error) {
+    if (missing_tiles_ && error == LoadError::not_found) {
+        missing_tiles_->AddMissing(version, tile_id);
+    }
+    for (auto& waiter : TakeWaiters(key)) {
+        waiter->NotifyError(error);
+    }
 }
 
 optional<MetatileId> DataProvider::GetOptimalMetatileId(const TileId& tile_id, int zoom_offset) {
@@ -1,20 +1,32 @@
 #pragma once
 
+#include <chrono>
 #include <experimental/optional>
 #include <memory>
+#include <mutex>
 #include <set>
+#include <unordered_map>
+#include <vector>
 
+#include "data_tile_cache.h"
+#include "missing_tile_cache.h"
 #include "tile_loader.h"
 #include "tile.h"
 
-class DataProvider {
+// Concurrent requests of the same base tile share one load
+class DataProvider : public std::enable_shared_from_this<DataProvider> {
 public:
     using zoom_groups_t = std::set<uint, std::greater<uint>>;
     using success_cb_t = LoadTask::result_cb_t;
     using error_cb_t = LoadTask::error_cb_t;
 
+    // Loaded tiles are kept in the cache under the loader name, if it is set. Tiles known to be missing are not
+    // loaded if missing_tiles is set. When a base tile is loaded, the base tiles within prefetch_radius around it
+    // are loaded with one batch, so requests of the neighbouring area find them in the cache.
     DataProvider(std::shared_ptr<TileLoader> loader, uint min_zoom, uint max_zoom,
-                 std::shared_ptr<zoom_groups_t> zoom_groups = nullptr);
+                 std::shared_ptr<zoom_groups_t> zoom_groups = nullptr,
+                 std::shared_ptr<DataTileCache> cache = nullptr, const std::string& loader_name = "",
+                 std::shared_ptr<MissingTileCache> missing_tiles = nullptr, uint prefetch_radius = 0);
 
     std::shared_ptr<LoadTask> GetTile(success_cb_t success_cb, error_cb_t error_cb, const TileId& tile_id,
                                       const std::string& version = "");
@@ -27,12 +39,40 @@ public:
         return loader_->HasVersion(version);
     }
 
+    // Callback is called when data of the version is reloaded, so whatever was derived from its tiles is stale.
+    // Should be called before the provider is used.
+    inline void AddReloadCallback(TileLoader::reload_cb_t cb) {
+        loader_->AddReloadCallback(std::move(cb));
+    }
+
 private:
+    struct InflightLoad {
+        std::chrono::steady_clock::time_point start_time;
+        // Every waiter may be cancelled (e.g. on timeout) without affecting the others
+        std::vector<std::shared_ptr<LoadTask>> waiters;
+    };
 
     std::experimental::optional<TileId> CalculateBaseTileId(const TileId& tile_id);
 
+    // Loads the base tiles around the base tile which are not cached or being loaded already. Loads of requested
+    // tiles go first.
+    void Prefetch(const TileId& base_tile_id, const std::string& version);
+
+    // Returns true if the task is the first one waiting for the tile, so the tile should be loaded. Null task
+    // only starts the load if there is none.
+    bool JoinLoad(const std::string& key, std::shared_ptr<LoadTask> task);
+    void FinishLoad(const std::string& key, Tile&& tile);
+    void FailLoad(const std::string& key, const std::string& version, const TileId& tile_id, LoadError error);
+    std::vector<std::shared_ptr<LoadTask>> TakeWaiters(const std::string& key);
+
     std::shared_ptr<TileLoader> loader_;
     std::shared_ptr<zoom_groups_t> zoom_groups_;
+    std::shared_ptr<DataTileCache> cache_;
+    std::string loader_name_;
+    std::shared_ptr<MissingTileCache> missing_tiles_;
     uint min_zoom_;
     uint max_zoom_;
+    uint prefetch_radius_;
+    std::unordered_map<std::string, InflightLoad> inflight_loads_;
+    std::mutex inflight_mux_;
 };
@@ -0,0 +1,99 @@
+#include "data_tile_cache.h"
+
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <vector>
+
+
+// Memory taken by an entry besides the tile data
+static const std::size_t kEntryOverhead = 128;
+
+DataTileCache::DataTileCache(std::size_t max_bytes, std::size_t num_shards) :
+        shards_(new Shard[std::max<std::size_t>(num_shards, 1)]),
+        num_shards_(std::max<std::size_t>(num_shards, 1)),
+        max_bytes_(max_bytes),
+        shard_max_bytes_(max_bytes / num_shards_) {}
+
+std::string DataTileCache::MakeKey(const std::string& loader_name, const std::string& version,
+                                   const TileId& tile_id) {
+    std::string key = loader_name;
+    key.append("/").append(version)
+       .append("/").append(std::to_string(tile_id.z))
+       .append("/").append(std::to_string(tile_id.x))
+       .append("/").append(std::to_string(tile_id.y));
+    return key;
+}
+
+DataTileCache::Shard& DataTileCache::GetShard(const std::string& key) {
+    return shards_[std::hash<std::string>()(key) % num_shards_];
+}
+
+std::shared_ptr<const Tile> DataTileCache::Get(const std::string& key) {
+    Shard& shard = GetShard(key);
+    std::lock_guard<std::mutex> lock(shard.mux);
+    auto index_itr = shard.index.find(key);
+    if (index_itr == shard.index.end()) {
+        ++misses_;
+        return nullptr;
+    }
+    ++hits_;
+    shard.lru.splice(shard.lru.begin(), shard.lru, index_itr->second);
+    return index_itr->second->tile;
+}
+
+void DataTileCache::Put(const std::string& key, std::shared_ptr<const Tile> tile) {
+    assert(tile);
+    const std::size_t bytes = tile->bytes().size() + key.size() + kEntryOverhead;
+    if (bytes > shard_max_bytes_ / 4) {
+        return;
+    }
+    // Evicted tiles are freed outside of the lock
+    std::vector<std::shared_ptr<const Tile>> evicted;
+    Shard& shard = GetShard(key);
+    std::lock_guard<std::mutex> lock(shard.mux);
+    // Tile could have been loaded by another request meanwhile
+    if (shard.index.find(key) != shard.index.end()) {
+        return;
+    }
+    shard.lru.push_front(Entry{key, std::move(tile), bytes});
+    shard.index[key] = shard.lru.begin();
+    shard.bytes += bytes;
+    bytes_ += bytes;
+    while (shard.bytes > shard_max_bytes_) {
+        Entry& entry = shard.lru.back();
+        shard.bytes -= entry.bytes;
+        bytes_ -= entry.bytes;
+        shard.index.erase(entry.key);
+        evicted.push_back(std::move(entry.tile));
+        shard.lru.pop_back();
+    }
+}
+
+void DataTileCache::Invalidate(const std::string& loader_name, const std::string& version) {
+    std::string prefix = loader_name + "/";
+    if (!version.empty()) {
+        prefix.append(version).append("/");
+    }
+    for (std::size_t i = 0; i < num_shards_; ++i) {
+        // Dropped tiles are freed outside of the lock
+        std::vector<std::shared_ptr<const Tile>> dropped;
+        Shard& shard = shards_[i];
+        std::lock_guard<std::mutex> lock(shard.mux);
+        for (auto entry_itr = shard.lru.begin(); entry_itr != shard.lru.end();) {
+            if (entry_itr->key.compare(0, prefix.size(), prefix) != 0) {
+                ++entry_itr;
+                continue;
+            }
+            shard.bytes -= entry_itr->bytes;
+            bytes_ -= entry_itr->bytes;
+            shard.index.erase(entry_itr->key);
+            dropped.push_back(std::move(entry_itr->tile));
+            entry_itr = shard.lru.erase(entry_itr);
+        }
+    }
+}
+
+DataTileCache::Stats DataTileCache::stats() const {
+    return Stats{hits_, misses_, bytes_, max_bytes_};
+}
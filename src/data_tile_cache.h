@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "tile.h"
+
+
+// Decompressed data tiles shared by all providers. Keys are split between shards, so concurrent lookups rarely
+// wait for each other. Every shard evicts least recently used tiles when its part of the memory limit is exceeded,
+// tiles which would take a large part of a shard are not cached at all.
+class DataTileCache {
+public:
+    struct Stats {
+        std::uint64_t hits;
+        std::uint64_t misses;
+        std::size_t bytes;
+        std::size_t max_bytes;
+    };
+
+    DataTileCache(std::size_t max_bytes, std::size_t num_shards = 16);
+
+    DataTileCache(const DataTileCache&) = delete;
+    DataTileCache& operator=(const DataTileCache&) = delete;
+
+    static std::string MakeKey(const std::string& loader_name, const std::string& version, const TileId& tile_id);
+
+    // Returns nullptr if the tile is not cached
+    std::shared_ptr<const Tile> Get(const std::string& key);
+    void Put(const std::string& key, std::shared_ptr<const Tile> tile);
+    // Drops tiles of the version loaded by the loader, tiles of all its versions if the version is empty
+    void Invalidate(const std::string& loader_name, const std::string& version);
+
+    Stats stats() const;
+
+private:
+    struct Entry {
+        std::string key;
+        std::shared_ptr<const Tile> tile;
+        std::size_t bytes;
+    };
+
+    struct Shard {
+        // Most recently used tiles are at the front
+        std::list<Entry> lru;
+        std::unordered_map<std::string, std::list<Entry>::iterator> index;
+        std::size_t bytes{0};
+        std::mutex mux;
+    };
+
+    Shard& GetShard(const std::string& key);
+
+    std::unique_ptr<Shard[]> shards_;
+    const std::size_t num_shards_;
+    const std::size_t max_bytes_;
+    const std::size_t shard_max_bytes_;
+    std::atomic<std::uint64_t> hits_{0};
+    std::atomic<std::uint64_t> misses_{0};
+    std::atomic<std::size_t> bytes_{0};
+};
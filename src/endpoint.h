@@ -27,4 +27,5 @@ struct EndpointParams {
     bool allow_layers_query{false};
     bool allow_utf_grid{false};
     bool auto_metatile_size{false};
+    bool requested_tile_first{true};
 };
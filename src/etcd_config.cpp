@@ -18,6 +18,15 @@ static const std::vector<std::pair<std::string, std::string>> kRootMapping = {
 static const std::vector<std::pair<std::string, std::string>> kRenderMapping = {
     {"/render/workers", "render/workers"},
     {"/render/queue_limit", "render/queue_limit"},
+    {"/render/subtile_workers", "render/subtile_workers"},
+    {"/render/encoder_workers", "render/encoder_workers"},
+    {"/render/buffer_pool", "render/buffer_pool"},
+    {"/render/mvt_cache", "render/mvt_cache"},
+    {"/render/coalesce", "render/coalesce"},
+    {"/render/affinity_queue_depth", "render/affinity_queue_depth"},
+    {"/render/task_classes", "render/task_classes"},
+    {"/render/style_cache_dir", "render/style_cache_dir"},
+    {"/render/lazy_styles", "render/lazy_styles"},
     {"/render/styles", "render/styles"},
 };
 
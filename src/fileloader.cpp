@@ -1,11 +1,90 @@
 #include "fileloader.h"
 
-#include <fstream>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include <sstream>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
 #include "util.h"
 
-FileLoader::FileLoader(const std::string& base_path, bool auto_version) : auto_version_(auto_version) {
+
+// Returns false if the file can not be read, error is set to the reason. Data is read into a string of its own,
+// so an uncompressed tile is moved into the tile buffer without copying.
+static bool ReadFile(const std::string& path, std::string& data, LoadError& error) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        error = errno == ENOENT ? LoadError::not_found : LoadError::internal_error;
+        if (errno != ENOENT) {
+            LOG(ERROR) << "Unable to open " << path << ": " << std::strerror(errno);
+        }
+        return false;
+    }
+    struct stat file_stat;
+    // One spare byte lets the loop see the end of file without growing the string
+    const std::size_t file_size = fstat(fd, &file_stat) == 0 ? static_cast<std::size_t>(file_stat.st_size) : 0;
+    data.resize(file_size ? file_size + 1 : 4096);
+    std::size_t size = 0;
+    while (true) {
+        if (size == data.size()) {
+            // File grew after fstat
+            data.resize(data.size() * 2);
+        }
+        ssize_t num_read = read(fd, &data[size], data.size() - size);
+        if (num_read == 0) {
+            break;
+        }
+        if (num_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG(ERROR) << "Unable to read " << path << ": " << std::strerror(errno);
+            close(fd);
+            error = LoadError::internal_error;
+            return false;
+        }
+        size += static_cast<std::size_t>(num_read);
+    }
+    close(fd);
+    data.resize(size);
+    return true;
+}
+
+void FileLoadWorker::ProcessTask(FileLoadTask task) noexcept {
+    for (FileLoad& load : task.loads) {
+        ProcessLoad(load);
+    }
+}
+
+void FileLoadWorker::ProcessLoad(FileLoad& load) noexcept {
+    if (load.task->cancelled()) {
+        return;
+    }
+    std::string data;
+    LoadError error = LoadError::internal_error;
+    if (!ReadFile(load.path, data, error)) {
+        load.task->NotifyError(error);
+        return;
+    }
+    std::shared_ptr<const std::string> buffer;
+    try {
+        buffer = util::decompress_shared(std::move(data));
+    } catch (const std::exception& e) {
+        LOG(ERROR) << "Unable to decompress tile " << load.path << ": " << e.what();
+        load.task->NotifyError(LoadError::internal_error);
+        return;
+    }
+    load.task->SetResult(Tile(load.tile_id, std::move(buffer)));
+}
+
+
+FileLoader::FileLoader(const std::string& base_path, bool auto_version, uint num_workers, std::size_t queue_depth) :
+        auto_version_(auto_version) {
     if (base_path.empty()) {
         base_path_ = "./";
     } else {
@@ -14,28 +93,50 @@ FileLoader::FileLoader(const std::string& base_path, bool auto_version) : auto_v
             base_path_.append("/");
         }
     }
+    read_pool_.SetQueueLimit(queue_depth);
+    // Background reads leave half of the workers to requested tiles
+    TaskClassLimits background_limits;
+    background_limits.max_running = std::max(num_workers / 2, 1u);
+    read_pool_.SetClassLimits(TaskClass::background, background_limits);
+    read_pool_.SetDropHandler([](FileLoadTask&& task) {
+        for (FileLoad& load : task.loads) {
+            load.task->NotifyError(LoadError::internal_error);
+        }
+    });
+    for (uint i = 0; i < std::max(num_workers, 1u); ++i) {
+        read_pool_.PushWorker(std::make_unique<FileLoadWorker>());
+    }
 }
 
-void FileLoader::Load(std::shared_ptr<LoadTask> task, const TileId& tile_id, const std::string& version) {
+std::string FileLoader::MakePath(const TileId& tile_id, const std::string& version) const {
     std::stringstream ss;
     ss << base_path_;
     if (auto_version_) {
         ss << version << '/';
     }
     ss << tile_id.z << '/' << tile_id.x << '/' << tile_id.y << ".mvt";
-    std::string path = ss.str();
-    std::ifstream file;
-    file.open(path);
-    if (file.is_open()) {
-        std::string tile_data((std::istreambuf_iterator<char>(file)),
-                              (std::istreambuf_iterator<char>()));
-        file.close();
-        Tile tile{tile_id, ""};
-        util::decompress(tile_data, tile.data);
-        task->SetResult(std::move(tile));
-        return;
+    return ss.str();
+}
+
+void FileLoader::Load(std::shared_ptr<LoadTask> task, const TileId& tile_id, const std::string& version) {
+    FileLoadTask load_task;
+    load_task.loads.push_back(FileLoad{std::move(task), tile_id, MakePath(tile_id, version)});
+    read_pool_.PostTask(std::move(load_task));
+}
+
+void FileLoader::LoadMany(std::shared_ptr<LoadManyTask> task, const std::vector<TileId>& tile_ids,
+                          const std::string& version, LoadPriority priority) {
+    auto batch = std::make_shared<LoadBatch>(std::move(task), tile_ids);
+    const TaskClass task_class = priority == LoadPriority::background ? TaskClass::background : TaskClass::interactive;
+    const std::size_t num_parts = std::max<std::size_t>(read_pool_.NumWorkers(), 1);
+    const std::size_t part_size = (tile_ids.size() + num_parts - 1) / num_parts;
+    for (std::size_t begin = 0; begin < tile_ids.size(); begin += part_size) {
+        FileLoadTask load_task;
+        for (std::size_t i = begin; i < std::min(begin + part_size, tile_ids.size()); ++i) {
+            load_task.loads.push_back(FileLoad{batch->MakeTileTask(i), tile_ids[i], MakePath(tile_ids[i], version)});
+        }
+        read_pool_.PostTask(std::move(load_task), task_class);
     }
-    task->NotifyError(LoadError::internal_error);
 }
 
 bool FileLoader::HasVersion(const std::string& version) const {
@@ -1,16 +1,51 @@
 #pragma once
 
+#include <string>
+#include <vector>
+
+#include "thread_pool.h"
 #include "tile_loader.h"
 
+
+struct FileLoad {
+    std::shared_ptr<LoadTask> task;
+    TileId tile_id;
+    std::string path;
+};
+
+// Files of a task are read one after another by one worker
+struct FileLoadTask {
+    std::vector<FileLoad> loads;
+};
+
+// Reads tiles with blocking calls off the event loop
+class FileLoadWorker : public Worker<FileLoadTask> {
+public:
+    void ProcessTask(FileLoadTask task) noexcept override;
+
+private:
+    void ProcessLoad(FileLoad& load) noexcept;
+};
+
 class FileLoader : public TileLoader {
 public:
-    FileLoader(const std::string& base_path = "", bool auto_version = false);
+    // Reads are queued up to queue_depth, oldest background reads fail first when it is exceeded. Zero means no
+    // limit.
+    FileLoader(const std::string& base_path = "", bool auto_version = false, uint num_workers = 4,
+               std::size_t queue_depth = 1000);
 
     void Load(std::shared_ptr<LoadTask> task, const TileId& tile_id, const std::string& version = "") override;
 
+    // Batch is split between the workers, every worker reads its part with one task
+    void LoadMany(std::shared_ptr<LoadManyTask> task, const std::vector<TileId>& tile_ids,
+                  const std::string& version = "", LoadPriority priority = LoadPriority::interactive) override;
+
     bool HasVersion(const std::string& version) const override;
 
 private:
+    std::string MakePath(const TileId& tile_id, const std::string& version) const;
+
     std::string base_path_;
     bool auto_version_;
+    ThreadPool<FileLoadWorker, FileLoadTask> read_pool_;
 };
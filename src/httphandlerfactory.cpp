@@ -3,6 +3,7 @@
 #include "couchbase_cacher.h"
 #include "json_util.h"
 #include "mon_handler.h"
+#include "stats_handler.h"
 #include "tile_handler.h"
 #include "util.h"
 
@@ -60,6 +61,7 @@ static std::shared_ptr<endpoints_map_t> ParseEndpoints(const Json::Value jendpoi
                 params->type = EndpointType::render;
                 params->allow_utf_grid = FromJson<bool>(jparams["allow_utfgrid"], false);
                 params->utfgrid_key = FromJson<std::string>(jparams["utfgrid_key"], "");
+                params->requested_tile_first = FromJson<bool>(jparams["requested_tile_first"], true);
                 if (params->allow_utf_grid && params->utfgrid_key.empty()) {
                     LOG(ERROR) << "No utfgrid key for endpoint '" << endpoint_path << "' provided!";
                     params->allow_utf_grid = false;
@@ -114,6 +116,10 @@ HttpHandlerFactory::HttpHandlerFactory(Config& config, std::shared_ptr<StatusMon
         config_(config),
         nodes_monitor_(nodes_monitor)
 {
+    // Reloaded data tiles are decoded again
+    data_manager_.AddReloadCallback([this](const std::string& provider_name, const std::string& version) {
+        render_manager_.InvalidateData(provider_name, version);
+    });
     update_observer_ = std::make_unique<ServerUpdateObserver>(*this);
     std::shared_ptr<const Json::Value> jserver_ptr = config.GetValue("server", update_observer_.get());
     assert(jserver_ptr);
@@ -175,6 +181,9 @@ proxygen::RequestHandler* HttpHandlerFactory::onRequest(proxygen::RequestHandler
     if (method == HTTPMethod::GET && path == "/mon") {
         return new MonHandler(monitor_);
     }
+    if (method == HTTPMethod::GET && path == "/stats") {
+        return new StatsHandler(render_manager_, data_manager_);
+    }
     auto endpoints = std::atomic_load(&endpoints_);
     return new TileHandler(render_manager_, data_manager_, endpoints, cacher_.get());
 }
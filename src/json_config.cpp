@@ -31,6 +31,16 @@ JsonConfig::JsonConfig(const std::string& file_path) {
     SetValue("app", std::make_shared<Json::Value>(root["app"]));
     SetValue("render/workers", std::make_shared<Json::Value>(root["render"]["workers"]));
     SetValue("render/queue_limit", std::make_shared<Json::Value>(root["render"]["queue_limit"]));
+    SetValue("render/subtile_workers", std::make_shared<Json::Value>(root["render"]["subtile_workers"]));
+    SetValue("render/encoder_workers", std::make_shared<Json::Value>(root["render"]["encoder_workers"]));
+    SetValue("render/buffer_pool", std::make_shared<Json::Value>(root["render"]["buffer_pool"]));
+    SetValue("render/mvt_cache", std::make_shared<Json::Value>(root["render"]["mvt_cache"]));
+    SetValue("render/coalesce", std::make_shared<Json::Value>(root["render"]["coalesce"]));
+    SetValue("render/affinity_queue_depth",
+             std::make_shared<Json::Value>(root["render"]["affinity_queue_depth"]));
+    SetValue("render/task_classes", std::make_shared<Json::Value>(root["render"]["task_classes"]));
+    SetValue("render/style_cache_dir", std::make_shared<Json::Value>(root["render"]["style_cache_dir"]));
+    SetValue("render/lazy_styles", std::make_shared<Json::Value>(root["render"]["lazy_styles"]));
     SetValue("render/styles", std::make_shared<Json::Value>(root["render"]["styles"]));
     SetValue("data", std::make_shared<Json::Value>(root["data"]));
     valid_ = true;
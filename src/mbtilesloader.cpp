@@ -0,0 +1,200 @@
+#include "mbtilesloader.h"
+
+#include <algorithm>
+#include <tuple>
+
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+#include "util.h"
+
+
+MBTilesWorker::~MBTilesWorker() {
+    for (auto& connection : connections_) {
+        sqlite3_finalize(connection.second.select_tile);
+        sqlite3_close(connection.second.db);
+    }
+}
+
+MBTilesWorker::Connection* MBTilesWorker::GetConnection(const std::string& path) {
+    auto connection_itr = connections_.find(path);
+    if (connection_itr != connections_.end()) {
+        return &connection_itr->second;
+    }
+    Connection connection;
+    // Connection is used only by this worker's thread
+    int rc = sqlite3_open_v2(path.c_str(), &connection.db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr);
+    if (rc == SQLITE_OK) {
+        const std::string mmap_pragma = "PRAGMA mmap_size=" + std::to_string(mmap_size_) + ";";
+        rc = sqlite3_exec(connection.db, mmap_pragma.c_str(), nullptr, nullptr, nullptr);
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v2(connection.db,
+                                "SELECT tile_data FROM tiles WHERE zoom_level=?1 AND tile_column=?2 AND tile_row=?3;",
+                                -1, &connection.select_tile, nullptr);
+    }
+    if (rc != SQLITE_OK) {
+        LOG(ERROR) << "Unable to open " << path << ": "
+                   << (connection.db ? sqlite3_errmsg(connection.db) : sqlite3_errstr(rc));
+        sqlite3_finalize(connection.select_tile);
+        sqlite3_close(connection.db);
+        return nullptr;
+    }
+    return &connections_.emplace(path, connection).first->second;
+}
+
+void MBTilesWorker::ProcessTask(MBTilesLoadTask task) noexcept {
+    Connection* connection = GetConnection(task.path);
+    for (MBTilesLoad& load : task.loads) {
+        if (!connection) {
+            load.task->NotifyError(LoadError::internal_error);
+        } else if (!load.task->cancelled()) {
+            LoadTile(*connection, load, task.path);
+        }
+    }
+}
+
+void MBTilesWorker::LoadTile(Connection& connection, MBTilesLoad& load, const std::string& path) noexcept {
+    sqlite3_stmt* stmt = connection.select_tile;
+    // Rows are numbered from the south in MBTiles
+    const TileId& tile_id = load.tile_id;
+    sqlite3_bind_int(stmt, 1, static_cast<int>(tile_id.z));
+    sqlite3_bind_int(stmt, 2, static_cast<int>(tile_id.x));
+    sqlite3_bind_int(stmt, 3, static_cast<int>((1u << tile_id.z) - 1 - tile_id.y));
+    const int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        const char* blob = static_cast<const char*>(sqlite3_column_blob(stmt, 0));
+        const std::size_t blob_size = static_cast<std::size_t>(sqlite3_column_bytes(stmt, 0));
+        std::shared_ptr<const std::string> buffer;
+        try {
+            buffer = util::decompress_shared(blob, blob_size);
+        } catch (const std::exception& e) {
+            LOG(ERROR) << "Unable to decompress tile: " << e.what() << " " << tile_id;
+        }
+        sqlite3_reset(stmt);
+        if (buffer) {
+            load.task->SetResult(Tile(tile_id, std::move(buffer)));
+        } else {
+            load.task->NotifyError(LoadError::internal_error);
+        }
+        return;
+    }
+    if (rc == SQLITE_DONE) {
+        load.task->NotifyError(LoadError::not_found);
+    } else {
+        LOG(ERROR) << "Unable to load tile from " << path << ": " << sqlite3_errmsg(connection.db);
+        load.task->NotifyError(LoadError::internal_error);
+    }
+    sqlite3_reset(stmt);
+}
+
+
+MBTilesLoader::MBTilesLoader(const std::string& path, bool auto_version,
+                             std::unordered_map<std::string, std::string> versions, uint num_workers,
+                             std::size_t queue_depth, std::size_t mmap_size) :
+        path_(path),
+        auto_version_(auto_version),
+        versions_(std::move(versions)) {
+    if (auto_version_ && !path_.empty() && path_.back() != '/') {
+        path_.append("/");
+    }
+    read_pool_.SetQueueLimit(queue_depth);
+    // Background queries leave half of the workers to requested tiles
+    TaskClassLimits background_limits;
+    background_limits.max_running = std::max(num_workers / 2, 1u);
+    read_pool_.SetClassLimits(TaskClass::background, background_limits);
+    read_pool_.SetDropHandler([](MBTilesLoadTask&& task) {
+        for (MBTilesLoad& load : task.loads) {
+            load.task->NotifyError(LoadError::internal_error);
+        }
+    });
+    for (uint i = 0; i < std::max(num_workers, 1u); ++i) {
+        read_pool_.PushWorker(std::make_unique<MBTilesWorker>(mmap_size));
+    }
+}
+
+bool MBTilesLoader::GetVersionPath(const std::string& version, std::string& path) const {
+    if (!versions_.empty()) {
+        auto version_itr = versions_.find(version);
+        if (version_itr == versions_.end()) {
+            return false;
+        }
+        path = version_itr->second;
+        return true;
+    }
+    if (!auto_version_) {
+        path = path_;
+        return true;
+    }
+    // Version must not lead out of the directory
+    if (version.empty() || version.find('/') != std::string::npos || version[0] == '.') {
+        return false;
+    }
+    path = path_ + version + ".mbtiles";
+    return true;
+}
+
+void MBTilesLoader::Load(std::shared_ptr<LoadTask> task, const TileId& tile_id, const std::string& version) {
+    std::string path;
+    if (!GetVersionPath(version, path)) {
+        task->NotifyError(LoadError::not_found);
+        return;
+    }
+    MBTilesLoadTask load_task;
+    load_task.loads.push_back(MBTilesLoad{std::move(task), tile_id});
+    load_task.path = std::move(path);
+    read_pool_.PostTask(std::move(load_task));
+}
+
+void MBTilesLoader::LoadMany(std::shared_ptr<LoadManyTask> task, const std::vector<TileId>& tile_ids,
+                             const std::string& version, LoadPriority priority) {
+    std::string path;
+    if (!GetVersionPath(version, path)) {
+        task->NotifyError(LoadError::not_found);
+        return;
+    }
+    auto batch = std::make_shared<LoadBatch>(std::move(task), tile_ids);
+    MBTilesLoadTask load_task;
+    load_task.loads.reserve(tile_ids.size());
+    for (std::size_t i = 0; i < tile_ids.size(); ++i) {
+        load_task.loads.push_back(MBTilesLoad{batch->MakeTileTask(i), tile_ids[i]});
+    }
+    // Neighbouring rows of the index are read together
+    std::sort(load_task.loads.begin(), load_task.loads.end(), [](const MBTilesLoad& lhs, const MBTilesLoad& rhs) {
+        return std::tie(lhs.tile_id.z, lhs.tile_id.x, lhs.tile_id.y) <
+               std::tie(rhs.tile_id.z, rhs.tile_id.x, rhs.tile_id.y);
+    });
+    load_task.path = std::move(path);
+    read_pool_.PostTask(std::move(load_task),
+                        priority == LoadPriority::background ? TaskClass::background : TaskClass::interactive);
+}
+
+bool MBTilesLoader::HasVersion(const std::string& version) const {
+    std::string path;
+    if (!GetVersionPath(version, path)) {
+        return false;
+    }
+    if (!auto_version_ || !versions_.empty()) {
+        return true;
+    }
+    {
+        std::lock_guard<std::mutex> lock(existing_versions_mux_);
+        if (existing_versions_.count(version)) {
+            return true;
+        }
+    }
+    if (access(path.c_str(), R_OK) != 0) {
+        return false;
+    }
+    bool inserted;
+    {
+        std::lock_guard<std::mutex> lock(existing_versions_mux_);
+        inserted = existing_versions_.insert(version).second;
+    }
+    // Version is published
+    if (inserted) {
+        NotifyReload(version);
+    }
+    return true;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <sqlite3.h>
+
+#include "thread_pool.h"
+#include "tile_loader.h"
+
+
+struct MBTilesLoad {
+    std::shared_ptr<LoadTask> task;
+    TileId tile_id;
+};
+
+// Tiles of a task are queried one after another on the connection to path
+struct MBTilesLoadTask {
+    std::vector<MBTilesLoad> loads;
+    std::string path;
+};
+
+// Every worker has its own read only connections, one per file, with the tile query prepared.
+class MBTilesWorker : public Worker<MBTilesLoadTask> {
+public:
+    explicit MBTilesWorker(std::size_t mmap_size) : mmap_size_(mmap_size) {}
+    ~MBTilesWorker();
+
+    void ProcessTask(MBTilesLoadTask task) noexcept override;
+
+private:
+    struct Connection {
+        sqlite3* db{nullptr};
+        sqlite3_stmt* select_tile{nullptr};
+    };
+
+    // Returns nullptr if the file can not be opened
+    Connection* GetConnection(const std::string& path);
+    void LoadTile(Connection& connection, MBTilesLoad& load, const std::string& path) noexcept;
+
+    std::size_t mmap_size_;
+    std::unordered_map<std::string, Connection> connections_;
+};
+
+// Loads tiles from MBTiles files. Version selects the file: explicitly listed versions map to their files, with
+// auto_version version is the file <path>/<version>.mbtiles, otherwise path is the only file for any version.
+class MBTilesLoader : public TileLoader {
+public:
+    // Reads are queued up to queue_depth, oldest background reads fail first when it is exceeded. Zero means no
+    // limit.
+    MBTilesLoader(const std::string& path, bool auto_version = false,
+                  std::unordered_map<std::string, std::string> versions = {}, uint num_workers = 4,
+                  std::size_t queue_depth = 1000, std::size_t mmap_size = 256 << 20);
+
+    void Load(std::shared_ptr<LoadTask> task, const TileId& tile_id, const std::string& version = "") override;
+
+    // Batch is queried by one worker in the index order of the tiles table
+    void LoadMany(std::shared_ptr<LoadManyTask> task, const std::vector<TileId>& tile_ids,
+                  const std::string& version = "", LoadPriority priority = LoadPriority::interactive) override;
+
+    bool HasVersion(const std::string& version) const override;
+
+private:
+    // Returns false if the version has no file
+    bool GetVersionPath(const std::string& version, std::string& path) const;
+
+    std::string path_;
+    bool auto_version_;
+    const std::unordered_map<std::string, std::string> versions_;
+    // Files found by auto_version are remembered, missing ones are checked again
+    mutable std::unordered_set<std::string> existing_versions_;
+    mutable std::mutex existing_versions_mux_;
+    ThreadPool<MBTilesWorker, MBTilesLoadTask> read_pool_;
+};
@@ -0,0 +1,166 @@
+#include "metatile_encoder.h"
+
+#include <algorithm>
+
+#include <mapnik/grid/grid_view.hpp>
+#include <mapnik/image_util.hpp>
+#include <mapnik/image_view.hpp>
+
+#include <glog/logging.h>
+
+#include "utfgrid_encode.h"
+
+
+static inline std::string GetTileData(std::size_t x, std::size_t y,
+                                      std::size_t width, std::size_t height,
+                                      const mapnik::image_rgba8& img) {
+    mapnik::image_view<mapnik::image_rgba8> view(x, y, width, height, img);
+    return mapnik::save_to_string(view, "png8:z=1");
+}
+
+static inline std::string GetTileData(std::size_t x, std::size_t y, std::size_t width,
+                                      std::size_t height, const mapnik::grid& grid) {
+    mapnik::grid_view view = const_cast<mapnik::grid&>(grid).get_view(x, y, width, height);
+    return encode_utfgrid(view);
+}
+
+
+template <typename T>
+class ImageEncodeJob : public EncodeJob {
+public:
+    ImageEncodeJob(std::shared_ptr<const T> image, Metatile&& metatile, std::shared_ptr<RenderTask> task,
+                   std::shared_ptr<RenderTask> tile_task, const TileId& tile_id) :
+            EncodeJob(std::move(metatile), std::move(task), std::move(tile_task), tile_id),
+            image_(std::move(image)) {
+        assert(image_);
+        assert(image_->width() % metatile_id().width() == 0);
+        assert(image_->height() % metatile_id().height() == 0);
+        tile_width_ = image_->width() / metatile_id().width();
+        tile_height_ = image_->height() / metatile_id().height();
+    }
+
+protected:
+    std::string EncodeTileData(std::size_t column, std::size_t row) const override {
+        return GetTileData(column * tile_width_, row * tile_height_, tile_width_, tile_height_, *image_);
+    }
+
+private:
+    std::shared_ptr<const T> image_;
+    std::size_t tile_width_;
+    std::size_t tile_height_;
+};
+
+
+EncodeJob::EncodeJob(Metatile&& metatile, std::shared_ptr<RenderTask> task,
+                     std::shared_ptr<RenderTask> tile_task, const TileId& tile_id) :
+        metatile_(std::move(metatile)),
+        task_(std::move(task)),
+        tile_task_(std::move(tile_task)),
+        tiles_left_(metatile_.tiles.size()) {
+    assert(task_ || tile_task_);
+    assert(!metatile_.tiles.empty());
+    if (tile_task_) {
+        auto tile_itr = std::find_if(metatile_.tiles.begin(), metatile_.tiles.end(),
+                                     [&tile_id](const Tile& tile) { return tile.id == tile_id; });
+        if (tile_itr == metatile_.tiles.end()) {
+            LOG(ERROR) << "Requested tile not found in metatile! " << tile_id;
+            tile_task_->NotifyError(RenderError::internal_error);
+            tile_task_.reset();
+        } else {
+            tile_idx_ = tile_itr - metatile_.tiles.begin();
+        }
+    }
+}
+
+bool EncodeJob::TileNeeded(std::size_t tile_idx) const noexcept {
+    if (task_ && !task_->cancelled()) {
+        return true;
+    }
+    return tile_task_ && tile_idx == tile_idx_ && !tile_task_->cancelled();
+}
+
+void EncodeJob::EncodeTile(std::size_t tile_idx) noexcept {
+    assert(tile_idx < metatile_.tiles.size());
+    const bool requested_tile = tile_task_ && tile_idx == tile_idx_;
+    // Do not waste time on the rest of tiles if the result is not needed anymore
+    if ((requested_tile || !failed_) && TileNeeded(tile_idx)) {
+        const std::size_t metatile_width = metatile_.id.width();
+        Tile& tile = metatile_.tiles[tile_idx];
+        bool encoded = false;
+        try {
+            tile.data = EncodeTileData(tile_idx % metatile_width, tile_idx / metatile_width);
+            encoded = true;
+        } catch (const std::exception& e) {
+            LOG(ERROR) << "Tile encoding error: " << e.what() << " " << tile.id;
+            failed_ = true;
+        }
+        if (requested_tile) {
+            if (encoded) {
+                Metatile tile_metatile{MetatileId(tile.id)};
+                // Tile data is still needed for the whole metatile
+                tile_metatile.tiles.front().data = task_ ? tile.data : std::move(tile.data);
+                tile_task_->SetResult(std::move(tile_metatile));
+            } else {
+                tile_task_->NotifyError(RenderError::internal_error);
+            }
+        }
+    }
+    if (!task_ || --tiles_left_ != 0) {
+        return;
+    }
+    if (failed_) {
+        task_->NotifyError(RenderError::internal_error);
+    } else {
+        task_->SetResult(std::move(metatile_));
+    }
+}
+
+
+void EncodeWorker::ProcessTask(EncodeTask task) noexcept {
+    assert(task.job);
+    task.job->EncodeTile(task.tile_idx);
+}
+
+
+MetatileEncoder::MetatileEncoder(uint num_workers) : num_workers_(num_workers) {
+    for (uint i = 0; i < num_workers; ++i) {
+        encode_pool_.PushWorker(std::make_unique<EncodeWorker>());
+    }
+}
+
+void MetatileEncoder::Encode(std::shared_ptr<const mapnik::image_rgba8> image, Metatile&& metatile,
+                             std::shared_ptr<RenderTask> task, std::shared_ptr<RenderTask> tile_task,
+                             const TileId& tile_id) {
+    Schedule(std::make_shared<ImageEncodeJob<mapnik::image_rgba8>>(std::move(image), std::move(metatile),
+                                                                   std::move(task), std::move(tile_task),
+                                                                   tile_id));
+}
+
+void MetatileEncoder::Encode(std::shared_ptr<const mapnik::grid> grid, Metatile&& metatile,
+                             std::shared_ptr<RenderTask> task, std::shared_ptr<RenderTask> tile_task,
+                             const TileId& tile_id) {
+    Schedule(std::make_shared<ImageEncodeJob<mapnik::grid>>(std::move(grid), std::move(metatile),
+                                                            std::move(task), std::move(tile_task), tile_id));
+}
+
+void MetatileEncoder::Schedule(std::shared_ptr<EncodeJob> job) {
+    if (job->has_tile_task()) {
+        // Requested tile does not wait in the encoder queue
+        job->EncodeTile(job->tile_idx());
+    }
+    if (!job->metatile_needed()) {
+        return;
+    }
+    const std::size_t num_tiles = job->num_tiles();
+    const bool encode_in_place = num_workers_ == 0 || num_tiles == 1;
+    for (std::size_t i = 0; i < num_tiles; ++i) {
+        if (job->has_tile_task() && i == job->tile_idx()) {
+            continue;
+        }
+        if (encode_in_place) {
+            job->EncodeTile(i);
+        } else {
+            encode_pool_.PostTask(EncodeTask{job, i});
+        }
+    }
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+#include <mapnik/image.hpp>
+#include <mapnik/grid/grid.hpp>
+
+#include "renderworker.h"
+#include "thread_pool.h"
+#include "worker.h"
+
+
+class EncodeJob {
+public:
+    // If tile_task is provided, tile with tile_id is delivered into it as soon as it is encoded.
+    // task receives the whole metatile and may be null if only that tile is needed.
+    EncodeJob(Metatile&& metatile, std::shared_ptr<RenderTask> task,
+              std::shared_ptr<RenderTask> tile_task = nullptr, const TileId& tile_id = TileId());
+    virtual ~EncodeJob() {}
+
+    // Encodes one tile of the metatile. Thread which encodes the last tile delivers the result.
+    void EncodeTile(std::size_t tile_idx) noexcept;
+
+    inline std::size_t num_tiles() const noexcept {
+        return metatile_.tiles.size();
+    }
+
+    inline bool has_tile_task() const noexcept {
+        return tile_task_ != nullptr;
+    }
+
+    // Whole metatile is not needed if its task has been cancelled while the metatile was rendered
+    inline bool metatile_needed() const noexcept {
+        return task_ && !task_->cancelled();
+    }
+
+    inline std::size_t tile_idx() const noexcept {
+        return tile_idx_;
+    }
+
+protected:
+    virtual std::string EncodeTileData(std::size_t column, std::size_t row) const = 0;
+
+    inline const MetatileId& metatile_id() const noexcept {
+        return metatile_.id;
+    }
+
+private:
+    bool TileNeeded(std::size_t tile_idx) const noexcept;
+
+    Metatile metatile_;
+    std::shared_ptr<RenderTask> task_;
+    std::shared_ptr<RenderTask> tile_task_;
+    std::size_t tile_idx_{0};
+    std::atomic<std::size_t> tiles_left_;
+    std::atomic_bool failed_{false};
+};
+
+
+struct EncodeTask {
+    std::shared_ptr<EncodeJob> job;
+    std::size_t tile_idx{0};
+};
+
+
+class EncodeWorker : public Worker<EncodeTask> {
+public:
+    void ProcessTask(EncodeTask task) noexcept override;
+};
+
+
+// Splits rendered metatiles to tiles and encodes them in parallel on a dedicated pool.
+class MetatileEncoder {
+public:
+    // If num_workers is zero tiles are encoded on the calling thread.
+    explicit MetatileEncoder(uint num_workers = 0);
+
+    // See EncodeJob for the meaning of tasks. Requested tile is encoded on the calling thread before the rest
+    // of the metatile is scheduled.
+    void Encode(std::shared_ptr<const mapnik::image_rgba8> image, Metatile&& metatile,
+                std::shared_ptr<RenderTask> task, std::shared_ptr<RenderTask> tile_task = nullptr,
+                const TileId& tile_id = TileId());
+
+    void Encode(std::shared_ptr<const mapnik::grid> grid, Metatile&& metatile,
+                std::shared_ptr<RenderTask> task, std::shared_ptr<RenderTask> tile_task = nullptr,
+                const TileId& tile_id = TileId());
+
+    // Expected time until a tile posted now is encoded by the pool. Zero if tiles are encoded by the render
+    // workers, their service time covers encoding then.
+    inline std::chrono::nanoseconds EstimateDelay() const {
+        return num_workers_ ? encode_pool_.EstimateDelay(TaskClass::interactive) : std::chrono::nanoseconds::zero();
+    }
+
+private:
+    void Schedule(std::shared_ptr<EncodeJob> job);
+
+    using encode_pool_t = ThreadPool<EncodeWorker, EncodeTask>;
+    encode_pool_t encode_pool_;
+    uint num_workers_;
+};
@@ -0,0 +1,101 @@
+#include "missing_tile_cache.h"
+
+#include <algorithm>
+
+
+MissingTileCache::MissingTileCache(std::chrono::seconds ttl, std::size_t max_tiles_per_version, filters_t filters,
+                                   std::size_t max_versions) :
+        ttl_(ttl),
+        max_tiles_per_version_(max_tiles_per_version),
+        filters_(std::move(filters)),
+        max_versions_(std::max<std::size_t>(max_versions, 1)) {}
+
+bool MissingTileCache::IsMissing(const std::string& version, const TileId& tile_id) {
+    // Filters are checked without the lock
+    auto filter_itr = filters_.find(version);
+    if (filter_itr != filters_.end()) {
+        std::shared_ptr<const TileFilter> filter = std::atomic_load(&filter_itr->second);
+        if (filter && !filter->MayContain(tile_id)) {
+            return true;
+        }
+    }
+    if (ttl_.count() == 0) {
+        return false;
+    }
+    const auto now = clock_t::now();
+    std::lock_guard<std::mutex> lock(mux_);
+    auto version_itr = versions_.find(version);
+    if (version_itr == versions_.end()) {
+        return false;
+    }
+    VersionTiles& tiles = version_itr->second;
+    tiles.last_used = now;
+    auto tile_itr = tiles.expire_times.find(MakeKey(tile_id));
+    if (tile_itr == tiles.expire_times.end()) {
+        return false;
+    }
+    if (tile_itr->second <= now) {
+        tiles.expire_times.erase(tile_itr);
+        return false;
+    }
+    return true;
+}
+
+void MissingTileCache::AddMissing(const std::string& version, const TileId& tile_id) {
+    if (ttl_.count() == 0 || max_tiles_per_version_ == 0) {
+        return;
+    }
+    const auto now = clock_t::now();
+    const auto expire_time = now + ttl_;
+    const std::uint64_t key = MakeKey(tile_id);
+    std::lock_guard<std::mutex> lock(mux_);
+    auto version_itr = versions_.find(version);
+    if (version_itr == versions_.end()) {
+        // New version replaces the least recently used one
+        if (versions_.size() >= max_versions_) {
+            versions_.erase(std::min_element(versions_.begin(), versions_.end(),
+                                             [](const std::pair<const std::string, VersionTiles>& lhs,
+                                                const std::pair<const std::string, VersionTiles>& rhs) {
+                                                 return lhs.second.last_used < rhs.second.last_used;
+                                             }));
+        }
+        version_itr = versions_.emplace(version, VersionTiles()).first;
+    }
+    VersionTiles& tiles = version_itr->second;
+    tiles.last_used = now;
+    tiles.expire_times[key] = expire_time;
+    tiles.order.emplace_back(key, expire_time);
+    Trim(tiles, now);
+}
+
+void MissingTileCache::Invalidate(const std::string& version) {
+    // Filter of the replaced data would reject new tiles
+    auto filter_itr = filters_.find(version);
+    if (filter_itr != filters_.end()) {
+        std::atomic_store(&filter_itr->second, std::shared_ptr<const TileFilter>());
+    }
+    std::lock_guard<std::mutex> lock(mux_);
+    versions_.erase(version);
+}
+
+void MissingTileCache::InvalidateAll() {
+    for (auto& filter : filters_) {
+        std::atomic_store(&filter.second, std::shared_ptr<const TileFilter>());
+    }
+    std::lock_guard<std::mutex> lock(mux_);
+    versions_.clear();
+}
+
+void MissingTileCache::Trim(VersionTiles& tiles, clock_t::time_point now) {
+    while (!tiles.order.empty() &&
+           (tiles.order.front().second <= now || tiles.expire_times.size() > max_tiles_per_version_ ||
+            tiles.order.size() > 2 * max_tiles_per_version_)) {
+        const auto& front = tiles.order.front();
+        // Tile added again later has a newer entry in the order
+        auto tile_itr = tiles.expire_times.find(front.first);
+        if (tile_itr != tiles.expire_times.end() && tile_itr->second == front.second) {
+            tiles.expire_times.erase(tile_itr);
+        }
+        tiles.order.pop_front();
+    }
+}
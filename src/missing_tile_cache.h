@@ -0,0 +1,60 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "tile.h"
+#include "tile_filter.h"
+
+
+// Data tiles known to be missing, so requests of empty areas do not reach the loader. Tiles which were not found
+// are remembered for ttl per version, only a few recently used versions are kept. Versions with a filter of
+// existing tiles answer from the filter without loads at all, until the version is invalidated.
+class MissingTileCache {
+public:
+    using filters_t = std::unordered_map<std::string, std::shared_ptr<const TileFilter>>;
+
+    // Zero ttl disables remembering of not found tiles, filters still work
+    MissingTileCache(std::chrono::seconds ttl, std::size_t max_tiles_per_version, filters_t filters = {},
+                     std::size_t max_versions = 4);
+
+    MissingTileCache(const MissingTileCache&) = delete;
+    MissingTileCache& operator=(const MissingTileCache&) = delete;
+
+    bool IsMissing(const std::string& version, const TileId& tile_id);
+    void AddMissing(const std::string& version, const TileId& tile_id);
+    // Forgets not found tiles and the filter of the version, e.g. when its data is reloaded
+    void Invalidate(const std::string& version);
+    void InvalidateAll();
+
+private:
+    using clock_t = std::chrono::steady_clock;
+
+    struct VersionTiles {
+        std::unordered_map<std::uint64_t, clock_t::time_point> expire_times;
+        // Tiles in the order they were added, expire times are ascending
+        std::deque<std::pair<std::uint64_t, clock_t::time_point>> order;
+        clock_t::time_point last_used;
+    };
+
+    static inline std::uint64_t MakeKey(const TileId& tile_id) noexcept {
+        return (std::uint64_t(tile_id.z) << 58) | (std::uint64_t(tile_id.x) << 29) | tile_id.y;
+    }
+
+    // Drops expired tiles and the oldest ones over the limit
+    void Trim(VersionTiles& tiles, clock_t::time_point now);
+
+    const std::chrono::seconds ttl_;
+    const std::size_t max_tiles_per_version_;
+    // Set of versions is never modified, filters are replaced atomically
+    filters_t filters_;
+    const std::size_t max_versions_;
+    std::unordered_map<std::string, VersionTiles> versions_;
+    std::mutex mux_;
+};
@@ -0,0 +1,228 @@
+#include "mvt_layer_cache.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <functional>
+
+#include <mapnik/query.hpp>
+
+#include <glog/logging.h>
+
+#include <vector_tile_config.hpp>
+#include <vector_tile_datasource_pbf.hpp>
+
+
+class DecodedFeatureset : public mapnik::Featureset {
+public:
+    DecodedFeatureset(std::shared_ptr<const DecodedMvtLayer> layer, std::vector<std::uint32_t> feature_indices) :
+            layer_(std::move(layer)),
+            feature_indices_(std::move(feature_indices)) {}
+
+    mapnik::feature_ptr next() override {
+        if (idx_ == feature_indices_.size()) {
+            return mapnik::feature_ptr();
+        }
+        return layer_->features_[feature_indices_[idx_++]];
+    }
+
+private:
+    const std::shared_ptr<const DecodedMvtLayer> layer_;
+    const std::vector<std::uint32_t> feature_indices_;
+    std::size_t idx_{0};
+};
+
+
+DecodedMvtLayer::DecodedMvtLayer(mapnik::layer_descriptor descriptor) : descriptor_(std::move(descriptor)) {}
+
+std::shared_ptr<const DecodedMvtLayer> DecodedMvtLayer::Decode(const protozero::pbf_reader& layer_pbf,
+                                                               const TileId& tile_id) {
+    try {
+        // Features get only the attributes which are queried
+        std::vector<std::string> keys;
+        protozero::pbf_reader keys_message(layer_pbf);
+        while (keys_message.next(mapnik::vector_tile_impl::Layer_Encoding::KEYS)) {
+            keys.push_back(keys_message.get_string());
+        }
+        mapnik::vector_tile_impl::tile_datasource_pbf ds(layer_pbf, tile_id.x, tile_id.y, tile_id.z, false);
+        // Features of the buffer may lie outside of the tile
+        const double world_size = 20037508.342789244;
+        mapnik::query q(mapnik::box2d<double>(-world_size, -world_size, world_size, world_size));
+        for (const std::string& key : keys) {
+            q.add_property_name(key);
+        }
+        std::shared_ptr<DecodedMvtLayer> layer(new DecodedMvtLayer(ds.get_descriptor()));
+        mapnik::featureset_ptr fs = ds.features(q);
+        if (fs) {
+            while (mapnik::feature_ptr feature = fs->next()) {
+                layer->AddFeature(std::move(feature));
+            }
+        }
+        layer->BuildIndex();
+        layer->geometry_type_ = ds.get_geometry_type();
+        return layer;
+    } catch (const std::exception& e) {
+        LOG(ERROR) << "Unable to decode mvt layer: " << e.what() << " " << tile_id;
+        return nullptr;
+    }
+}
+
+void DecodedMvtLayer::AddFeature(mapnik::feature_ptr feature) {
+    const mapnik::box2d<double> envelope = feature->envelope();
+    if (!envelope.valid()) {
+        return;
+    }
+    min_x_.push_back(envelope.minx());
+    min_y_.push_back(envelope.miny());
+    max_x_.push_back(envelope.maxx());
+    max_y_.push_back(envelope.maxy());
+    extent_.expand_to_include(envelope);
+    features_.push_back(std::move(feature));
+}
+
+void DecodedMvtLayer::BuildIndex() {
+    static const std::size_t kFeaturesPerCell = 8;
+    static const std::size_t kMaxGridSize = 64;
+
+    const std::size_t num_features = features_.size();
+    grid_size_ = static_cast<std::size_t>(std::ceil(std::sqrt(double(num_features) / kFeaturesPerCell)));
+    grid_size_ = std::min(std::max<std::size_t>(grid_size_, 1), kMaxGridSize);
+    // Degenerated extent (e.g. a single point) still has cells of non zero size
+    cell_width_ = std::max(extent_.width(), 1.0) / grid_size_;
+    cell_height_ = std::max(extent_.height(), 1.0) / grid_size_;
+
+    // Features are counted per cell first, so cell lists are laid out in one array
+    auto for_each_cell = [this](std::size_t feature_idx, const std::function<void(std::size_t)>& fn) {
+        const std::size_t x0 = CellColumn(min_x_[feature_idx]);
+        const std::size_t x1 = CellColumn(max_x_[feature_idx]);
+        const std::size_t y0 = CellRow(min_y_[feature_idx]);
+        const std::size_t y1 = CellRow(max_y_[feature_idx]);
+        for (std::size_t y = y0; y <= y1; ++y) {
+            for (std::size_t x = x0; x <= x1; ++x) {
+                fn(y * grid_size_ + x);
+            }
+        }
+    };
+    cell_offsets_.assign(grid_size_ * grid_size_ + 1, 0);
+    for (std::size_t i = 0; i < num_features; ++i) {
+        for_each_cell(i, [this](std::size_t cell) { ++cell_offsets_[cell + 1]; });
+    }
+    for (std::size_t cell = 1; cell < cell_offsets_.size(); ++cell) {
+        cell_offsets_[cell] += cell_offsets_[cell - 1];
+    }
+    cell_features_.resize(cell_offsets_.back());
+    std::vector<std::uint32_t> cell_fill(cell_offsets_.begin(), cell_offsets_.end() - 1);
+    for (std::size_t i = 0; i < num_features; ++i) {
+        for_each_cell(i, [this, &cell_fill, i](std::size_t cell) {
+            cell_features_[cell_fill[cell]++] = static_cast<std::uint32_t>(i);
+        });
+    }
+}
+
+std::vector<std::uint32_t> DecodedMvtLayer::Query(const mapnik::box2d<double>& bbox) const {
+    std::vector<std::uint32_t> result;
+    if (features_.empty() || !bbox.intersects(extent_)) {
+        return result;
+    }
+    const std::size_t x0 = CellColumn(bbox.minx());
+    const std::size_t x1 = CellColumn(bbox.maxx());
+    const std::size_t y0 = CellRow(bbox.miny());
+    const std::size_t y1 = CellRow(bbox.maxy());
+    if (x0 == 0 && y0 == 0 && x1 == grid_size_ - 1 && y1 == grid_size_ - 1) {
+        // Query covers the whole grid, scanning the envelopes is cheaper than merging cell lists
+        for (std::uint32_t i = 0; i < features_.size(); ++i) {
+            if (intersects(i, bbox)) {
+                result.push_back(i);
+            }
+        }
+        return result;
+    }
+    for (std::size_t y = y0; y <= y1; ++y) {
+        for (std::size_t x = x0; x <= x1; ++x) {
+            const std::size_t cell = y * grid_size_ + x;
+            for (std::uint32_t offset = cell_offsets_[cell]; offset < cell_offsets_[cell + 1]; ++offset) {
+                const std::uint32_t feature_idx = cell_features_[offset];
+                if (intersects(feature_idx, bbox)) {
+                    result.push_back(feature_idx);
+                }
+            }
+        }
+    }
+    // Features spanning several cells are found more than once, the tile order is kept for rendering
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+mapnik::featureset_ptr DecodedMvtLayer::features(const mapnik::box2d<double>& bbox) const {
+    return std::make_shared<DecodedFeatureset>(shared_from_this(), Query(bbox));
+}
+
+
+MvtLayerCache::MvtLayerCache(std::size_t max_features) : max_features_(max_features) {}
+
+std::string MvtLayerCache::MakeKey(const std::string& provider, const std::string& version, const TileId& tile_id,
+                                   const std::string& layer_name) {
+    std::string key = provider;
+    key.append("/").append(version)
+       .append("/").append(std::to_string(tile_id.z))
+       .append("/").append(std::to_string(tile_id.x))
+       .append("/").append(std::to_string(tile_id.y))
+       .append("/").append(layer_name);
+    return key;
+}
+
+std::shared_ptr<const DecodedMvtLayer> MvtLayerCache::Get(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mux_);
+    auto index_itr = index_.find(key);
+    if (index_itr == index_.end()) {
+        return nullptr;
+    }
+    lru_.splice(lru_.begin(), lru_, index_itr->second);
+    return index_itr->second->second;
+}
+
+void MvtLayerCache::Put(const std::string& key, std::shared_ptr<const DecodedMvtLayer> layer) {
+    assert(layer);
+    const std::size_t num_features = layer->num_features();
+    if (num_features > max_features_) {
+        return;
+    }
+    // Evicted layers are freed outside of the lock
+    std::vector<std::shared_ptr<const DecodedMvtLayer>> evicted;
+    std::lock_guard<std::mutex> lock(mux_);
+    // Layer could have been decoded by another render meanwhile
+    if (index_.find(key) != index_.end()) {
+        return;
+    }
+    lru_.emplace_front(key, std::move(layer));
+    index_[key] = lru_.begin();
+    num_features_ += num_features;
+    while (num_features_ > max_features_) {
+        entry_t& entry = lru_.back();
+        num_features_ -= entry.second->num_features();
+        index_.erase(entry.first);
+        evicted.push_back(std::move(entry.second));
+        lru_.pop_back();
+    }
+}
+
+void MvtLayerCache::Invalidate(const std::string& provider, const std::string& version) {
+    std::string prefix = provider + "/";
+    if (!version.empty()) {
+        prefix.append(version).append("/");
+    }
+    // Dropped layers are freed outside of the lock
+    std::vector<std::shared_ptr<const DecodedMvtLayer>> dropped;
+    std::lock_guard<std::mutex> lock(mux_);
+    for (auto entry_itr = lru_.begin(); entry_itr != lru_.end();) {
+        if (entry_itr->first.compare(0, prefix.size(), prefix) != 0) {
+            ++entry_itr;
+            continue;
+        }
+        num_features_ -= entry_itr->second->num_features();
+        index_.erase(entry_itr->first);
+        dropped.push_back(std::move(entry_itr->second));
+        entry_itr = lru_.erase(entry_itr);
+    }
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/optional.hpp>
+
+#include <mapnik/box2d.hpp>
+#include <mapnik/datasource.hpp>
+#include <mapnik/feature.hpp>
+#include <mapnik/featureset.hpp>
+
+#include <protozero/pbf_reader.hpp>
+
+#include "tile.h"
+
+
+// Features of a vector tile layer decoded once with all attributes. Features are never modified after decoding,
+// so the layer is shared by renders on different threads. Feature envelopes are stored by columns and indexed with
+// a uniform grid over the layer extent, so a query touches only the features near its bbox.
+class DecodedMvtLayer : public std::enable_shared_from_this<DecodedMvtLayer> {
+public:
+    // Returns nullptr if the layer can not be decoded
+    static std::shared_ptr<const DecodedMvtLayer> Decode(const protozero::pbf_reader& layer_pbf,
+                                                         const TileId& tile_id);
+
+    DecodedMvtLayer(const DecodedMvtLayer&) = delete;
+    DecodedMvtLayer& operator=(const DecodedMvtLayer&) = delete;
+
+    // Features which envelopes intersect bbox, in the order of the tile
+    mapnik::featureset_ptr features(const mapnik::box2d<double>& bbox) const;
+
+    inline const mapnik::box2d<double>& extent() const noexcept {
+        return extent_;
+    }
+
+    inline const boost::optional<mapnik::datasource_geometry_t>& geometry_type() const noexcept {
+        return geometry_type_;
+    }
+
+    inline const mapnik::layer_descriptor& descriptor() const noexcept {
+        return descriptor_;
+    }
+
+    inline std::size_t num_features() const noexcept {
+        return features_.size();
+    }
+
+private:
+    friend class DecodedFeatureset;
+
+    DecodedMvtLayer(mapnik::layer_descriptor descriptor);
+
+    void AddFeature(mapnik::feature_ptr feature);
+    void BuildIndex();
+    // Indices of the features which envelopes intersect bbox in ascending order
+    std::vector<std::uint32_t> Query(const mapnik::box2d<double>& bbox) const;
+
+    // Coordinates outside of the extent are clamped to the border cells
+    inline std::size_t CellColumn(double x) const noexcept {
+        return CellIndex((x - extent_.minx()) / cell_width_);
+    }
+
+    inline std::size_t CellRow(double y) const noexcept {
+        return CellIndex((y - extent_.miny()) / cell_height_);
+    }
+
+    inline std::size_t CellIndex(double position) const noexcept {
+        if (!(position > 0)) {
+            return 0;
+        }
+        if (position >= grid_size_) {
+            return grid_size_ - 1;
+        }
+        return static_cast<std::size_t>(position);
+    }
+
+    inline bool intersects(std::uint32_t feature_idx, const mapnik::box2d<double>& bbox) const noexcept {
+        return min_x_[feature_idx] <= bbox.maxx() && max_x_[feature_idx] >= bbox.minx() &&
+               min_y_[feature_idx] <= bbox.maxy() && max_y_[feature_idx] >= bbox.miny();
+    }
+
+    // Features without geometry are not stored
+    std::vector<mapnik::feature_ptr> features_;
+    std::vector<double> min_x_;
+    std::vector<double> min_y_;
+    std::vector<double> max_x_;
+    std::vector<double> max_y_;
+    mapnik::box2d<double> extent_;
+    // Square grid, features of cell i are cell_features_[cell_offsets_[i]] .. cell_features_[cell_offsets_[i + 1] - 1]
+    std::size_t grid_size_{0};
+    double cell_width_{0};
+    double cell_height_{0};
+    std::vector<std::uint32_t> cell_offsets_;
+    std::vector<std::uint32_t> cell_features_;
+    boost::optional<mapnik::datasource_geometry_t> geometry_type_;
+    mapnik::layer_descriptor descriptor_;
+};
+
+
+// Decoded layers shared between renders, so metatiles which use the same data tile and different render types
+// of one metatile do not decode it again. Least recently used layers are evicted.
+class MvtLayerCache {
+public:
+    // max_features limits the total number of cached features
+    explicit MvtLayerCache(std::size_t max_features);
+
+    MvtLayerCache(const MvtLayerCache&) = delete;
+    MvtLayerCache& operator=(const MvtLayerCache&) = delete;
+
+    static std::string MakeKey(const std::string& provider, const std::string& version, const TileId& tile_id,
+                               const std::string& layer_name);
+
+    // Returns nullptr if the layer is not cached
+    std::shared_ptr<const DecodedMvtLayer> Get(const std::string& key);
+    void Put(const std::string& key, std::shared_ptr<const DecodedMvtLayer> layer);
+    // Drops layers of the version of the provider, layers of all its versions if the version is empty
+    void Invalidate(const std::string& provider, const std::string& version);
+
+private:
+    using entry_t = std::pair<std::string, std::shared_ptr<const DecodedMvtLayer>>;
+
+    // Most recently used layers are at the front
+    std::list<entry_t> lru_;
+    std::unordered_map<std::string, std::list<entry_t>::iterator> index_;
+    std::size_t max_features_;
+    std::size_t num_features_{0};
+    std::mutex mux_;
+};
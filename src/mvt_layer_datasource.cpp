@@ -0,0 +1,39 @@
+#include "mvt_layer_datasource.h"
+
+MvtLayerDatasource::MvtLayerDatasource(std::shared_ptr<const DecodedMvtLayer> layer,
+                                       const mapnik::box2d<double>& envelope,
+                                       std::shared_ptr<const AsyncTaskBase> task)
+    : datasource(mapnik::parameters()),
+      layer_(std::move(layer)),
+      envelope_(envelope),
+      task_(std::move(task))
+{
+    assert(layer_);
+}
+
+mapnik::datasource::datasource_t MvtLayerDatasource::type() const {
+    return mapnik::datasource::Vector;
+}
+
+boost::optional<mapnik::datasource_geometry_t> MvtLayerDatasource::get_geometry_type() const {
+    return layer_->geometry_type();
+}
+
+mapnik::featureset_ptr MvtLayerDatasource::features(mapnik::query const& q) const {
+    if (task_ && task_->cancelled()) {
+        return mapnik::featureset_ptr();
+    }
+    return layer_->features(q.get_bbox());
+}
+
+mapnik::featureset_ptr MvtLayerDatasource::features_at_point(mapnik::coord2d const& pt, double tol) const {
+    return layer_->features(mapnik::box2d<double>(pt.x - tol, pt.y - tol, pt.x + tol, pt.y + tol));
+}
+
+mapnik::box2d<double> MvtLayerDatasource::envelope() const {
+    return envelope_;
+}
+
+mapnik::layer_descriptor MvtLayerDatasource::get_descriptor() const {
+    return layer_->descriptor();
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <mapnik/datasource.hpp>
+
+#include "async_task.h"
+#include "mvt_layer_cache.h"
+
+// Layer of a data tile for a single render. Features are taken from the decoded layer, which is built once per
+// data tile and may be shared with other renders, so queries with different bboxes do not decode the tile again.
+class MvtLayerDatasource : public mapnik::datasource {
+public:
+    // If task is cancelled no more features are returned, so the rest of layers are skipped
+    MvtLayerDatasource(std::shared_ptr<const DecodedMvtLayer> layer, const mapnik::box2d<double>& envelope,
+                       std::shared_ptr<const AsyncTaskBase> task = nullptr);
+
+    datasource_t type() const override;
+    boost::optional<mapnik::datasource_geometry_t> get_geometry_type() const override;
+    mapnik::featureset_ptr features(mapnik::query const& q) const override;
+    mapnik::featureset_ptr features_at_point(mapnik::coord2d const& pt, double tol = 0) const override;
+    mapnik::box2d<double> envelope() const override;
+    mapnik::layer_descriptor get_descriptor() const override;
+
+private:
+    const std::shared_ptr<const DecodedMvtLayer> layer_;
+    const mapnik::box2d<double> envelope_;
+    const std::shared_ptr<const AsyncTaskBase> task_;
+};
@@ -0,0 +1,123 @@
+#include "render_buffer_pool.h"
+
+#include <sys/mman.h>
+
+#include <vector>
+
+#include <glog/logging.h>
+
+
+static inline std::size_t BufferSize(const mapnik::image_rgba8& image) {
+    return image.size();
+}
+
+static inline std::size_t BufferSize(const mapnik::grid& grid) {
+    return grid.data().size();
+}
+
+static void AdviseHugePages(unsigned char* data, std::size_t size) {
+#ifdef MADV_HUGEPAGE
+    // Only whole huge pages inside the buffer can be backed
+    const std::uintptr_t huge_page_size = 2 * 1024 * 1024;
+    const std::uintptr_t begin = (reinterpret_cast<std::uintptr_t>(data) + huge_page_size - 1) &
+                                 ~(huge_page_size - 1);
+    const std::uintptr_t end = (reinterpret_cast<std::uintptr_t>(data) + size) & ~(huge_page_size - 1);
+    if (begin < end && madvise(reinterpret_cast<void*>(begin), end - begin, MADV_HUGEPAGE) != 0) {
+        LOG(WARNING) << "Unable to use huge pages for render buffer!";
+    }
+#endif
+}
+
+
+RenderBufferPool::RenderBufferPool(std::size_t max_idle_bytes, bool huge_pages) :
+        max_idle_bytes_(max_idle_bytes),
+        huge_pages_(huge_pages) {}
+
+std::shared_ptr<mapnik::image_rgba8> RenderBufferPool::AcquireImage(std::size_t width, std::size_t height) {
+    std::unique_ptr<mapnik::image_rgba8> image = TakeIdle(idle_images_, width, height);
+    if (image) {
+        image->set(0);
+        image->set_premultiplied(false);
+        image->painted(false);
+    } else {
+        image = std::make_unique<mapnik::image_rgba8>(static_cast<int>(width), static_cast<int>(height));
+        if (huge_pages_) {
+            AdviseHugePages(image->bytes(), image->size());
+        }
+    }
+    return Wrap(std::move(image));
+}
+
+std::shared_ptr<mapnik::grid> RenderBufferPool::AcquireGrid(std::size_t width, std::size_t height,
+                                                            const std::string& key) {
+    std::unique_ptr<mapnik::grid> grid = TakeIdle(idle_grids_, width, height);
+    if (grid) {
+        grid->clear();
+        grid->set_key(key);
+    } else {
+        grid = std::make_unique<mapnik::grid>(width, height, key);
+        if (huge_pages_) {
+            AdviseHugePages(grid->data().bytes(), grid->data().size());
+        }
+    }
+    return Wrap(std::move(grid));
+}
+
+template <typename T>
+std::unique_ptr<T> RenderBufferPool::TakeIdle(idle_list_t<T>& idle, std::size_t width, std::size_t height) {
+    std::lock_guard<std::mutex> lock(mux_);
+    for (auto buffer_itr = idle.begin(); buffer_itr != idle.end(); ++buffer_itr) {
+        T& buffer = **buffer_itr;
+        if (buffer.width() == width && buffer.height() == height) {
+            std::unique_ptr<T> result = std::move(*buffer_itr);
+            idle.erase(buffer_itr);
+            idle_bytes_ -= BufferSize(*result);
+            return result;
+        }
+    }
+    return nullptr;
+}
+
+template <typename T>
+std::shared_ptr<T> RenderBufferPool::Wrap(std::unique_ptr<T> buffer) {
+    // Pool may be destroyed before the last buffer is released
+    std::weak_ptr<RenderBufferPool> pool = shared_from_this();
+    return std::shared_ptr<T>(buffer.release(), [pool](T* buffer_ptr) {
+        std::unique_ptr<T> released(buffer_ptr);
+        if (auto pool_ptr = pool.lock()) {
+            pool_ptr->Release(std::move(released));
+        }
+    });
+}
+
+void RenderBufferPool::Release(std::unique_ptr<mapnik::image_rgba8> image) {
+    ReleaseImpl(std::move(image), idle_images_);
+}
+
+void RenderBufferPool::Release(std::unique_ptr<mapnik::grid> grid) {
+    ReleaseImpl(std::move(grid), idle_grids_);
+}
+
+template <typename T>
+void RenderBufferPool::ReleaseImpl(std::unique_ptr<T> buffer, idle_list_t<T>& idle) {
+    const std::size_t buffer_size = BufferSize(*buffer);
+    if (buffer_size > max_idle_bytes_) {
+        return;
+    }
+    // Evicted buffers are freed outside of the lock
+    std::vector<std::unique_ptr<mapnik::image_rgba8>> evicted_images;
+    std::vector<std::unique_ptr<mapnik::grid>> evicted_grids;
+    std::lock_guard<std::mutex> lock(mux_);
+    idle.push_front(std::move(buffer));
+    idle_bytes_ += buffer_size;
+    while (idle_bytes_ > max_idle_bytes_ && !idle_grids_.empty()) {
+        idle_bytes_ -= BufferSize(*idle_grids_.back());
+        evicted_grids.push_back(std::move(idle_grids_.back()));
+        idle_grids_.pop_back();
+    }
+    while (idle_bytes_ > max_idle_bytes_ && !idle_images_.empty()) {
+        idle_bytes_ -= BufferSize(*idle_images_.back());
+        evicted_images.push_back(std::move(idle_images_.back()));
+        idle_images_.pop_back();
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <mapnik/image.hpp>
+#include <mapnik/grid/grid.hpp>
+
+
+// Keeps image and grid buffers of finished renders for reuse, so metatile renders do not allocate, page fault and
+// free tens of megabytes every time. Buffers are returned into the pool when the last reference is released,
+// which may happen on any thread (e.g. in the encoder).
+class RenderBufferPool : public std::enable_shared_from_this<RenderBufferPool> {
+public:
+    // max_idle_bytes limits memory held by buffers which are not in use. If huge_pages is set, transparent
+    // huge pages are requested for new buffers.
+    RenderBufferPool(std::size_t max_idle_bytes, bool huge_pages = false);
+
+    RenderBufferPool(const RenderBufferPool&) = delete;
+    RenderBufferPool& operator=(const RenderBufferPool&) = delete;
+
+    // Returned image is cleared
+    std::shared_ptr<mapnik::image_rgba8> AcquireImage(std::size_t width, std::size_t height);
+    std::shared_ptr<mapnik::grid> AcquireGrid(std::size_t width, std::size_t height, const std::string& key);
+
+private:
+    template <typename T>
+    using idle_list_t = std::list<std::unique_ptr<T>>;
+
+    template <typename T>
+    std::unique_ptr<T> TakeIdle(idle_list_t<T>& idle, std::size_t width, std::size_t height);
+
+    template <typename T>
+    std::shared_ptr<T> Wrap(std::unique_ptr<T> buffer);
+
+    void Release(std::unique_ptr<mapnik::image_rgba8> image);
+    void Release(std::unique_ptr<mapnik::grid> grid);
+
+    template <typename T>
+    void ReleaseImpl(std::unique_ptr<T> buffer, idle_list_t<T>& idle);
+
+    // Most recently released buffers are at the front
+    idle_list_t<mapnik::image_rgba8> idle_images_;
+    idle_list_t<mapnik::grid> idle_grids_;
+    std::size_t max_idle_bytes_;
+    std::size_t idle_bytes_{0};
+    std::mutex mux_;
+    bool huge_pages_;
+};
@@ -0,0 +1,430 @@
+#include "render_style.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <iomanip>
+#include <iterator>
+#include <sstream>
+
+#include <boost/filesystem.hpp>
+
+#include <mapnik/feature_type_style.hpp>
+#include <mapnik/layer.hpp>
+#include <mapnik/load_map.hpp>
+#include <mapnik/rule.hpp>
+#include <mapnik/save_map.hpp>
+
+#include <glog/logging.h>
+
+#include "load_map.h"
+#include "load_mvt_map.h"
+
+static const std::string kMapProj = "+proj=merc +a=6378137 +b=6378137 +lat_ts=0.0 +lon_0=0.0 +x_0=0.0 +y_0=0.0 +k=1.0 "
+                                    "+units=m +nadgrids=@null +wktext +no_defs +over";
+
+static thread_local const LayerContext* current_context = nullptr;
+
+
+// Datasource of a shared style layer. Data of mvt layers comes from the current render context, other layers
+// use their own datasource. Layers which are not requested have no data.
+class LayerDataSource : public mapnik::datasource {
+public:
+    LayerDataSource(std::string layer_name, mapnik::datasource_ptr ds) :
+            datasource(mapnik::parameters()),
+            layer_name_(std::move(layer_name)),
+            p_datasource_(std::move(ds)) {}
+
+    datasource_t type() const override {
+        const mapnik::datasource* ds = CurrentDataSource();
+        return ds ? ds->type() : mapnik::datasource::Vector;
+    }
+
+    boost::optional<mapnik::datasource_geometry_t> get_geometry_type() const override {
+        const mapnik::datasource* ds = CurrentDataSource();
+        return ds ? ds->get_geometry_type() : boost::optional<mapnik::datasource_geometry_t>();
+    }
+
+    mapnik::featureset_ptr features(mapnik::query const& q) const override {
+        const mapnik::datasource* ds = CurrentDataSource();
+        return ds ? ds->features(q) : mapnik::featureset_ptr();
+    }
+
+    mapnik::featureset_ptr features_at_point(mapnik::coord2d const& pt, double tol = 0) const override {
+        const mapnik::datasource* ds = CurrentDataSource();
+        return ds ? ds->features_at_point(pt, tol) : mapnik::featureset_ptr();
+    }
+
+    mapnik::box2d<double> envelope() const override {
+        const mapnik::datasource* ds = CurrentDataSource();
+        return ds ? ds->envelope() : mapnik::box2d<double>();
+    }
+
+    mapnik::layer_descriptor get_descriptor() const override {
+        const mapnik::datasource* ds = CurrentDataSource();
+        return ds ? ds->get_descriptor() : mapnik::layer_descriptor(layer_name_, "utf-8");
+    }
+
+private:
+    const mapnik::datasource* CurrentDataSource() const {
+        const LayerContext* context = current_context;
+        if (context && context->layers && context->layers->find(layer_name_) == context->layers->end()) {
+            return nullptr;
+        }
+        if (p_datasource_) {
+            return p_datasource_.get();
+        }
+        if (!context || !context->mvt_datasources) {
+            return nullptr;
+        }
+        auto ds_itr = context->mvt_datasources->find(layer_name_);
+        return ds_itr != context->mvt_datasources->end() ? ds_itr->second.get() : nullptr;
+    }
+
+    const std::string layer_name_;
+    const mapnik::datasource_ptr p_datasource_;
+};
+
+
+static void CalculateLayersSD(mapnik::Map& map) {
+    const auto& styles = map.styles();
+    for (auto &layer : map.layers()) {
+        double min_sd = 1000000000;
+        double max_sd = 0;
+        for (const auto &style_name : layer.styles()) {
+            const auto style_itr = styles.find(style_name);
+            if (style_itr == styles.end()) {
+                continue;
+            }
+            const auto& style = style_itr->second;
+            for (const auto &rule : style.get_rules()) {
+                min_sd = std::min(min_sd, rule.get_min_scale());
+                max_sd = std::max(max_sd, rule.get_max_scale());
+            }
+        }
+        if (min_sd != 1000000000) {
+            layer.set_minimum_scale_denominator(min_sd);
+        }
+        if (max_sd != 0) {
+            layer.set_maximum_scale_denominator(max_sd);
+        }
+    }
+}
+
+
+StyleSet::StyleSet(std::shared_ptr<const style_map_t> styles) : styles_(std::move(styles)) {}
+
+void StyleSet::EnableLazyLoading(std::size_t max_loaded, std::unordered_set<std::string> pinned_styles,
+                                 std::string snapshot_dir) {
+    max_loaded_ = std::max<std::size_t>(max_loaded, 1);
+    pinned_styles_ = std::move(pinned_styles);
+    snapshot_dir_ = std::move(snapshot_dir);
+    if (pinned_styles_.size() >= max_loaded_) {
+        LOG(WARNING) << pinned_styles_.size() << " pinned styles take all " << max_loaded_
+                     << " loaded style slots, other styles are evicted as soon as another one is loaded";
+    }
+}
+
+std::shared_ptr<const RenderStyle> StyleSet::GetStyle(const std::string& style_name) {
+    std::shared_ptr<const style_map_t> loaded_styles = styles();
+    if (loaded_styles) {
+        auto style_itr = loaded_styles->find(style_name);
+        if (style_itr != loaded_styles->end()) {
+            if (lazy_loading()) {
+                TouchStyle(style_name);
+            }
+            return style_itr->second;
+        }
+    }
+    if (!lazy_loading()) {
+        return nullptr;
+    }
+
+    std::promise<std::shared_ptr<const RenderStyle>> load_promise;
+    style_load_t style_load;
+    StyleInfo style_info;
+    std::uint64_t commit_count = 0;
+    {
+        std::lock_guard<std::mutex> lock(mux_);
+        loaded_styles = styles();
+        if (loaded_styles) {
+            auto style_itr = loaded_styles->find(style_name);
+            if (style_itr != loaded_styles->end()) {
+                TouchStyle(style_name);
+                return style_itr->second;
+            }
+        }
+        auto style_info_itr = style_infos_.find(style_name);
+        if (style_info_itr == style_infos_.end() || failed_styles_.find(style_name) != failed_styles_.end()) {
+            return nullptr;
+        }
+        auto loading_itr = loading_styles_.find(style_name);
+        if (loading_itr != loading_styles_.end()) {
+            style_load = loading_itr->second;
+        } else {
+            loading_styles_.emplace(style_name, load_promise.get_future().share());
+            style_info = style_info_itr->second;
+            commit_count = commit_count_;
+        }
+    }
+    if (style_load.valid()) {
+        return style_load.get();
+    }
+
+    // Other styles are loaded and used while this one is parsed
+    std::shared_ptr<const RenderStyle> style = RenderStyle::Load(style_info, snapshot_dir_);
+    {
+        std::lock_guard<std::mutex> lock(mux_);
+        // Commit has replaced the style infos and the loads, the style is used only by the current waiters
+        if (commit_count == commit_count_) {
+            loading_styles_.erase(style_name);
+            if (!style) {
+                LOG(ERROR) << "Unable to load style " << style_name;
+                failed_styles_.insert(style_name);
+            } else {
+                loaded_styles = styles();
+                auto new_styles = loaded_styles ? std::make_shared<style_map_t>(*loaded_styles) :
+                                                  std::make_shared<style_map_t>();
+                (*new_styles)[style_name] = style;
+                TouchStyle(style_name);
+                EvictStyles(*new_styles, style_name);
+                std::atomic_store(&styles_, std::shared_ptr<const style_map_t>(std::move(new_styles)));
+            }
+        }
+    }
+    load_promise.set_value(style);
+    return style;
+}
+
+void StyleSet::TouchStyle(const std::string& style_name) {
+    std::lock_guard<std::mutex> lock(lru_mux_);
+    auto index_itr = lru_index_.find(style_name);
+    if (index_itr != lru_index_.end()) {
+        lru_.splice(lru_.begin(), lru_, index_itr->second);
+    } else {
+        lru_.push_front(style_name);
+        lru_index_[style_name] = lru_.begin();
+    }
+}
+
+void StyleSet::EvictStyles(style_map_t& styles, const std::string& kept_style) {
+    std::lock_guard<std::mutex> lock(lru_mux_);
+    auto lru_itr = lru_.end();
+    while (styles.size() > max_loaded_ && lru_itr != lru_.begin()) {
+        --lru_itr;
+        if (pinned(*lru_itr) || *lru_itr == kept_style) {
+            continue;
+        }
+        styles.erase(*lru_itr);
+        lru_index_.erase(*lru_itr);
+        lru_itr = lru_.erase(lru_itr);
+    }
+}
+
+bool StyleSet::UpdateStyles(std::shared_ptr<const style_map_t> styles, const std::vector<StyleInfo>& style_infos) {
+    std::lock_guard<std::mutex> lock(mux_);
+    if (!styles || updated_styles_) {
+        return false;
+    }
+    updated_styles_ = std::move(styles);
+    updated_style_infos_.clear();
+    for (const StyleInfo& style_info : style_infos) {
+        updated_style_infos_[style_info.name] = style_info;
+    }
+    return true;
+}
+
+bool StyleSet::CommitUpdate(const style_map_t* update_ptr) {
+    std::lock_guard<std::mutex> lock(mux_);
+    if (!updated_styles_ || updated_styles_.get() != update_ptr) {
+        return false;
+    }
+    if (lazy_loading()) {
+        std::lock_guard<std::mutex> lru_lock(lru_mux_);
+        for (auto lru_itr = lru_.begin(); lru_itr != lru_.end();) {
+            if (updated_styles_->find(*lru_itr) == updated_styles_->end()) {
+                lru_index_.erase(*lru_itr);
+                lru_itr = lru_.erase(lru_itr);
+            } else {
+                ++lru_itr;
+            }
+        }
+        for (const auto& style_pair : *updated_styles_) {
+            if (lru_index_.find(style_pair.first) == lru_index_.end()) {
+                lru_.push_back(style_pair.first);
+                lru_index_[style_pair.first] = std::prev(lru_.end());
+            }
+        }
+    }
+    std::atomic_store(&styles_, std::move(updated_styles_));
+    updated_styles_.reset();
+    style_infos_.swap(updated_style_infos_);
+    updated_style_infos_.clear();
+    failed_styles_.clear();
+    loading_styles_.clear();
+    ++commit_count_;
+    return true;
+}
+
+bool StyleSet::CancelUpdate(const style_map_t* update_ptr) {
+    std::lock_guard<std::mutex> lock(mux_);
+    if (!updated_styles_ || updated_styles_.get() != update_ptr) {
+        return false;
+    }
+    updated_styles_.reset();
+    updated_style_infos_.clear();
+    return true;
+}
+
+
+static std::uint64_t Fnv1a(const std::string& data, std::uint64_t hash = 14695981039346656037ull) {
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static bool IsMvtStylePath(const std::string& path) {
+    return path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+}
+
+// Bumped when conversion of mvt styles changes, so snapshots made by an older converter are not used
+static const int kSnapshotFormat = 1;
+
+// Size and modification time stand for the contents, so the file is not read. Empty if it does not exist.
+static std::string FileStamp(const std::string& path) {
+    struct stat file_stat;
+    if (stat(path.c_str(), &file_stat) != 0) {
+        return std::string();
+    }
+    std::ostringstream stamp;
+    stamp << file_stat.st_ino << ":" << file_stat.st_size << ":"
+          << file_stat.st_mtim.tv_sec << "." << file_stat.st_mtim.tv_nsec;
+    return stamp.str();
+}
+
+// Snapshot is keyed by the style path, file stamp, version and converter format. Converter skips patterns
+// which do not exist, so adding or removing resources (it changes their directories) makes a new snapshot too.
+// Returns empty string if the style file does not exist.
+static std::string MakeSnapshotPath(const std::string& snapshot_dir, const std::string& style_path, uint version) {
+    const std::string style_stamp = FileStamp(style_path);
+    if (style_stamp.empty()) {
+        return std::string();
+    }
+    const std::string style_dir = boost::filesystem::path(style_path).parent_path().string();
+    const std::string stamp = style_stamp + "/" + FileStamp(style_dir + "/res") + "/" +
+                              FileStamp(style_dir + "/fonts");
+    std::ostringstream snapshot_path;
+    snapshot_path << snapshot_dir << "/" << std::hex << std::setfill('0')
+                  << std::setw(16) << Fnv1a(style_path) << "-"
+                  << std::setw(16) << Fnv1a(stamp) << "-"
+                  << std::dec << version << "-f" << kSnapshotFormat << ".xml";
+    return snapshot_path.str();
+}
+
+static bool LoadSnapshot(mapnik::Map& map, const std::string& snapshot_path) {
+    boost::system::error_code ec;
+    if (!boost::filesystem::exists(snapshot_path, ec)) {
+        return false;
+    }
+    try {
+        mapnik::load_map(map, snapshot_path);
+    } catch (const std::exception& e) {
+        LOG(WARNING) << "Unable to load style snapshot " << snapshot_path << ": " << e.what();
+        return false;
+    }
+    return true;
+}
+
+static void SaveSnapshot(const mapnik::Map& map, const std::string& snapshot_path) {
+    // Other processes may load the snapshot at the same time, so it is renamed when complete
+    const std::string tmp_path = snapshot_path + ".tmp" + std::to_string(getpid()) + "-" +
+                                 std::to_string(reinterpret_cast<std::uintptr_t>(&map));
+    try {
+        mapnik::save_map(map, tmp_path);
+    } catch (const std::exception& e) {
+        LOG(WARNING) << "Unable to save style snapshot " << snapshot_path << ": " << e.what();
+        std::remove(tmp_path.c_str());
+        return;
+    }
+    if (std::rename(tmp_path.c_str(), snapshot_path.c_str()) != 0) {
+        LOG(WARNING) << "Unable to save style snapshot " << snapshot_path;
+        std::remove(tmp_path.c_str());
+    }
+}
+
+
+RenderStyle::ScopedContext::ScopedContext(const LayerContext& context) : prev_context_(current_context) {
+    current_context = &context;
+}
+
+RenderStyle::ScopedContext::~ScopedContext() {
+    current_context = prev_context_;
+}
+
+RenderStyle::RenderStyle() : map_(256, 256, kMapProj) {}
+
+std::shared_ptr<const RenderStyle> RenderStyle::Load(const StyleInfo& style_info, const std::string& snapshot_dir) {
+    if (style_info.name.empty()) {
+        LOG(ERROR) << "Empty style name";
+        return nullptr;
+    }
+    std::shared_ptr<RenderStyle> style(new RenderStyle());
+    style->allow_grid_render_ = style_info.allow_grid_render;
+    style->version_ = style_info.version;
+    mapnik::Map& map = style->map_;
+    // Only converted mvt styles are worth a snapshot, mapnik XML is loaded as fast as the snapshot itself
+    std::string snapshot_path;
+    std::string style_path = style_info.path;
+    if (!snapshot_dir.empty() && IsMvtStylePath(style_path)) {
+        // Snapshot is loaded from another directory, so resources must be referenced by absolute paths
+        style_path = boost::filesystem::absolute(style_path).string();
+        snapshot_path = MakeSnapshotPath(snapshot_dir, style_path, style_info.version);
+        if (!snapshot_path.empty() && LoadSnapshot(map, snapshot_path)) {
+            style->FinishLoad();
+            return style;
+        }
+        // Snapshot could have been loaded partially
+        map = mapnik::Map(256, 256, kMapProj);
+    }
+    try {
+        if (!style_path.empty()) {
+            me::load_map(map, style_path);
+        } else if (style_info.data && !style_info.data->empty()){
+            if (style_info.type == StyleInfo::Type::mapnik) {
+                mapnik::load_map_string(map, *style_info.data, false, style_info.base_path);
+            } else {
+                load_mvt_map_string(map, *style_info.data, false, style_info.base_path);
+            }
+        } else {
+            LOG(ERROR) << "No style path, nor style data provided!";
+            return nullptr;
+        }
+    } catch (const std::exception& e) {
+        LOG(ERROR) << "Error while loading style: " << e.what();
+        return nullptr;
+    }
+    if (!snapshot_path.empty()) {
+        SaveSnapshot(map, snapshot_path);
+    }
+    style->FinishLoad();
+    return style;
+}
+
+void RenderStyle::FinishLoad() {
+    mapnik::Map& map = map_;
+    CalculateLayersSD(map);
+    // Mvt layers (layers without ds) get data of the render, 900913 proj is set for them
+    const int mvt_buf_size = 256;
+    for (mapnik::layer& layer : map.layers()) {
+        if (layer.datasource() == nullptr) {
+            has_mvt_layers_ = true;
+            layer.set_srs(map.srs());
+            layer.set_buffer_size(mvt_buf_size);
+        }
+        layer.set_datasource(std::make_shared<LayerDataSource>(layer.name(), layer.datasource()));
+    }
+}
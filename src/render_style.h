@@ -0,0 +1,164 @@
+#pragma once
+
+#include <atomic>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <mapnik/datasource.hpp>
+#include <mapnik/map.hpp>
+
+
+struct StyleInfo {
+    enum class Type : std::uint8_t {
+        mapnik,
+        mvt
+    };
+
+    std::string name;
+    std::string path;
+    std::string base_path;
+    std::shared_ptr<std::string> data;
+    uint version{0};
+    Type type{Type::mapnik};
+    bool allow_grid_render{false};
+};
+
+
+// State of a single render which layers of a shared style read on the rendering thread
+struct LayerContext {
+    // Data of mvt layers by layer name
+    const std::unordered_map<std::string, mapnik::datasource_ptr>* mvt_datasources{nullptr};
+    // If set, only these layers are rendered
+    const std::set<std::string>* layers{nullptr};
+};
+
+
+// Style parsed once and shared by all render workers. Map is never modified after loading: size and extent are
+// passed to renderers with mapnik::request, mvt data and active layers with ScopedContext.
+class RenderStyle {
+public:
+    // Returns nullptr if the style can not be loaded. If snapshot_dir is set, converted mvt styles are saved
+    // there as mapnik XML and loaded from it next time while the style file and version are the same.
+    static std::shared_ptr<const RenderStyle> Load(const StyleInfo& style_info,
+                                                   const std::string& snapshot_dir = std::string());
+
+    // Binds the context to layers of all styles rendered on the current thread while alive
+    class ScopedContext {
+    public:
+        explicit ScopedContext(const LayerContext& context);
+        ~ScopedContext();
+
+        ScopedContext(const ScopedContext&) = delete;
+        ScopedContext& operator=(const ScopedContext&) = delete;
+
+    private:
+        const LayerContext* prev_context_;
+    };
+
+    RenderStyle(const RenderStyle&) = delete;
+    RenderStyle& operator=(const RenderStyle&) = delete;
+
+    inline const mapnik::Map& map() const noexcept {
+        return map_;
+    }
+
+    inline uint version() const noexcept {
+        return version_;
+    }
+
+    inline bool allow_grid_render() const noexcept {
+        return allow_grid_render_;
+    }
+
+    inline bool has_mvt_layers() const noexcept {
+        return has_mvt_layers_;
+    }
+
+private:
+    RenderStyle();
+
+    // Prepares loaded map for shared rendering
+    void FinishLoad();
+
+    mapnik::Map map_;
+    uint version_{0};
+    bool allow_grid_render_{false};
+    bool has_mvt_layers_{false};
+};
+
+using style_map_t = std::unordered_map<std::string, std::shared_ptr<const RenderStyle>>;
+
+
+// Styles used by all render workers. Update is prepared first and then committed to all workers at once,
+// renders which have already started keep the styles they took.
+class StyleSet {
+public:
+    explicit StyleSet(std::shared_ptr<const style_map_t> styles = nullptr);
+
+    // Styles which are not pinned are loaded on first use. At most max_loaded styles are kept, the least
+    // recently used ones are evicted. Should be called before the first update.
+    void EnableLazyLoading(std::size_t max_loaded, std::unordered_set<std::string> pinned_styles,
+                           std::string snapshot_dir);
+
+    inline bool lazy_loading() const noexcept {
+        return max_loaded_ != 0;
+    }
+
+    inline bool pinned(const std::string& style_name) const {
+        return pinned_styles_.find(style_name) != pinned_styles_.end();
+    }
+
+    // Loaded styles
+    inline std::shared_ptr<const style_map_t> styles() const {
+        return std::atomic_load(&styles_);
+    }
+
+    // Loads the style if it is not loaded yet. Returns nullptr if the style is unknown or can not be loaded.
+    std::shared_ptr<const RenderStyle> GetStyle(const std::string& style_name);
+
+    // style_infos describe all styles of the update, including the ones to be loaded lazily.
+    // Returns false if another update is pending.
+    bool UpdateStyles(std::shared_ptr<const style_map_t> styles, const std::vector<StyleInfo>& style_infos);
+    bool CommitUpdate(const style_map_t* update_ptr);
+    bool CancelUpdate(const style_map_t* update_ptr);
+
+    // Changes with every committed update, so results of the previous styles can be told apart
+    inline std::uint64_t commit_count() const noexcept {
+        return commit_count_;
+    }
+
+private:
+    using style_load_t = std::shared_future<std::shared_ptr<const RenderStyle>>;
+
+    void TouchStyle(const std::string& style_name);
+    // Drops least recently used styles which are not pinned from styles, except the kept one
+    void EvictStyles(style_map_t& styles, const std::string& kept_style);
+
+    std::shared_ptr<const style_map_t> styles_;
+    std::shared_ptr<const style_map_t> updated_styles_;
+    std::unordered_map<std::string, StyleInfo> style_infos_;
+    std::unordered_map<std::string, StyleInfo> updated_style_infos_;
+    // Styles which failed to load are not retried until the next update
+    std::unordered_set<std::string> failed_styles_;
+    // Workers which need a style being loaded wait for it instead of parsing it again
+    std::unordered_map<std::string, style_load_t> loading_styles_;
+    // Loads started before the last commit are not added to the styles. Changed under mux_.
+    std::atomic<std::uint64_t> commit_count_{0};
+    // Guards updates and lazy loads, not held while a style is parsed
+    std::mutex mux_;
+
+    std::size_t max_loaded_{0};
+    std::unordered_set<std::string> pinned_styles_;
+    std::string snapshot_dir_;
+    // Most recently used styles are at the front
+    std::list<std::string> lru_;
+    std::unordered_map<std::string, std::list<std::string>::iterator> lru_index_;
+    std::mutex lru_mux_;
+};
@@ -1,12 +1,20 @@
 #include "rendermanager.h"
 
+#include <algorithm>
 #include <fstream>
+#include <iterator>
+#include <thread>
 
 #include <glog/logging.h>
 
+#include "json_util.h"
+#include "mvt_layer_cache.h"
 #include "subtiler.h"
 
 
+using json_util::FromJson;
+
+
 static bool ParseStyleInfo(const std::string& name, const Json::Value& jstyle_info, StyleInfo& style_info) {
     style_info.name = name;
     if (style_info.name.empty()) {
@@ -55,6 +63,83 @@ static bool ParseStyles(const Json::Value& jstyles, std::vector<StyleInfo>& styl
 }
 
 
+static void ParseTaskClassLimits(const Json::Value& jlimits, TaskClassLimits& limits) {
+    if (!jlimits.isObject()) {
+        return;
+    }
+    limits.queue_limit = FromJson<uint>(jlimits["queue_limit"], limits.queue_limit);
+    limits.max_running = FromJson<uint>(jlimits["max_running"], limits.max_running);
+    limits.max_wait = std::chrono::milliseconds(FromJson<uint>(jlimits["max_wait_ms"],
+                                                                      static_cast<uint>(limits.max_wait.count())));
+}
+
+// Styles are parsed in parallel, styles which versions are not changed are taken from current_styles.
+// Returns nullptr if any style can not be loaded, unless failed styles are skipped.
+static std::shared_ptr<const style_map_t> LoadStyles(const std::vector<StyleInfo>& styles,
+                                                     const style_map_t* current_styles, bool skip_failed,
+                                                     const std::string& snapshot_dir) {
+    std::vector<std::shared_ptr<const RenderStyle>> loaded(styles.size());
+    std::vector<std::size_t> to_load;
+    for (std::size_t i = 0; i < styles.size(); ++i) {
+        if (current_styles) {
+            auto style_itr = current_styles->find(styles[i].name);
+            if (style_itr != current_styles->end() && style_itr->second->version() == styles[i].version) {
+                loaded[i] = style_itr->second;
+                continue;
+            }
+        }
+        to_load.push_back(i);
+    }
+
+    std::atomic<std::size_t> next_idx{0};
+    auto load = [&styles, &loaded, &to_load, &next_idx, &snapshot_dir] {
+        for (std::size_t i = next_idx++; i < to_load.size(); i = next_idx++) {
+            loaded[to_load[i]] = RenderStyle::Load(styles[to_load[i]], snapshot_dir);
+        }
+    };
+    const std::size_t num_threads = std::min<std::size_t>(to_load.size(),
+                                                           std::max(std::thread::hardware_concurrency(), 1u));
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < num_threads; ++i) {
+        threads.emplace_back(load);
+    }
+    load();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    auto style_map = std::make_shared<style_map_t>();
+    for (std::size_t i = 0; i < styles.size(); ++i) {
+        if (!loaded[i]) {
+            LOG(ERROR) << "Unable to load style " << styles[i].name;
+            if (!skip_failed) {
+                return nullptr;
+            }
+            continue;
+        }
+        (*style_map)[styles[i].name] = std::move(loaded[i]);
+    }
+    return style_map;
+}
+
+
+// Render shared by coalesced requests is cancelled when all of them are
+class CoalescedRenderTask : public RenderTask {
+public:
+    CoalescedRenderTask(result_cb_t success_callback, error_cb_t error_callback,
+                        std::function<bool ()> abandoned) :
+            RenderTask(std::move(success_callback), std::move(error_callback)),
+            abandoned_(std::move(abandoned)) {}
+
+    bool cancelled() const noexcept override {
+        return RenderTask::cancelled() || abandoned_();
+    }
+
+private:
+    std::function<bool ()> abandoned_;
+};
+
+
 void StyleUpdateObserver::OnUpdate(std::shared_ptr<Json::Value> value) {
     assert(value);
     rm_.PostStyleUpdate(std::move(value));
@@ -71,6 +156,15 @@ RenderManager::RenderManager(Config& config) :
     const Json::Value& jqueue_limit = *jqueue_limit_ptr;
     uint queue_limit = jqueue_limit.isIntegral() ? jqueue_limit.asUInt() : 1000u;
     render_pool_.SetQueueLimit(queue_limit);
+    auto drop_handler = [](TileWorkTask&& task) {
+        task.async_task->NotifyError(RenderError::overloaded);
+        if (task.metatile_task) {
+            task.metatile_task->NotifyError(RenderError::overloaded);
+        }
+    };
+    render_pool_.SetDropHandler(drop_handler);
+    subtile_pool_.SetQueueLimit(queue_limit);
+    subtile_pool_.SetDropHandler(drop_handler);
 
     std::shared_ptr<std::vector<StyleInfo>> styles;
     std::shared_ptr<const Json::Value> jstyles = config.GetValue("render/styles", &update_observer_);
@@ -93,34 +187,399 @@ RenderManager::RenderManager(Config& config) :
     } else {
         LOG(WARNING) << "No styles provided";
     }
+    std::shared_ptr<const Json::Value> jstyle_cache_dir_ptr = config.GetValue("render/style_cache_dir");
+    if (jstyle_cache_dir_ptr) {
+        style_snapshot_dir_ = FromJson<std::string>(*jstyle_cache_dir_ptr, std::string());
+    }
+    std::shared_ptr<const Json::Value> jlazy_styles_ptr = config.GetValue("render/lazy_styles");
+    if (jlazy_styles_ptr && jlazy_styles_ptr->isObject()) {
+        const Json::Value& jlazy_styles = *jlazy_styles_ptr;
+        std::unordered_set<std::string> pinned_styles;
+        const Json::Value& jpinned = jlazy_styles["pinned"];
+        if (jpinned.isArray()) {
+            for (const Json::Value& jstyle_name : jpinned) {
+                if (jstyle_name.isString()) {
+                    pinned_styles.insert(jstyle_name.asString());
+                }
+            }
+        }
+        style_set_.EnableLazyLoading(FromJson<uint>(jlazy_styles["max_loaded"], 16u), std::move(pinned_styles),
+                                     style_snapshot_dir_);
+    }
+    // Every style is parsed once and shared by all workers
+    if (styles) {
+        auto style_map = LoadEagerStyles(*styles, true);
+        for (const StyleInfo& style_info : *styles) {
+            const bool lazy = style_set_.lazy_loading() && !style_set_.pinned(style_info.name);
+            if (!lazy && style_map->find(style_info.name) == style_map->end()) {
+                style_names_->erase(style_info.name);
+            }
+        }
+        style_set_.UpdateStyles(style_map, *styles);
+        style_set_.CommitUpdate(style_map.get());
+    }
+
+    std::shared_ptr<const Json::Value> jencoder_workers_ptr = config.GetValue("render/encoder_workers");
+    uint num_encoder_workers = std::thread::hardware_concurrency();
+    if (jencoder_workers_ptr && jencoder_workers_ptr->isIntegral()) {
+        num_encoder_workers = jencoder_workers_ptr->asUInt();
+    }
+    encoder_ = std::make_unique<MetatileEncoder>(num_encoder_workers);
+
+    std::shared_ptr<const Json::Value> jcoalesce_ptr = config.GetValue("render/coalesce");
+    if (jcoalesce_ptr) {
+        coalesce_renders_ = FromJson<bool>(*jcoalesce_ptr, coalesce_renders_);
+    }
+
+    uint max_idle_buffers_mb = 512;
+    bool huge_pages = false;
+    std::shared_ptr<const Json::Value> jbuffer_pool_ptr = config.GetValue("render/buffer_pool");
+    if (jbuffer_pool_ptr && jbuffer_pool_ptr->isObject()) {
+        const Json::Value& jbuffer_pool = *jbuffer_pool_ptr;
+        max_idle_buffers_mb = FromJson<uint>(jbuffer_pool["max_idle_mb"], max_idle_buffers_mb);
+        huge_pages = FromJson<bool>(jbuffer_pool["huge_pages"], huge_pages);
+    }
+    auto buffer_pool = std::make_shared<RenderBufferPool>(std::size_t(max_idle_buffers_mb) << 20, huge_pages);
+
+    // Decoded data tile layers are shared between renders
+    uint max_cached_features = 200000;
+    std::shared_ptr<const Json::Value> jmvt_cache_ptr = config.GetValue("render/mvt_cache");
+    if (jmvt_cache_ptr && jmvt_cache_ptr->isObject()) {
+        max_cached_features = FromJson<uint>((*jmvt_cache_ptr)["max_features"], max_cached_features);
+    }
+    if (max_cached_features) {
+        layer_cache_ = std::make_shared<MvtLayerCache>(max_cached_features);
+    }
 
     std::shared_ptr<const Json::Value> jworkers_ptr = config.GetValue("render/workers");
     assert(jworkers_ptr);
     const Json::Value& jworkers = *jworkers_ptr;
     uint num_workers = jworkers.isIntegral() ? jworkers.asUInt() : std::thread::hardware_concurrency();
+
+    TaskClassLimits interactive_limits;
+    TaskClassLimits subtile_limits;
+    std::shared_ptr<const Json::Value> jtask_classes_ptr = config.GetValue("render/task_classes");
+    if (jtask_classes_ptr && jtask_classes_ptr->isObject()) {
+        const Json::Value& jtask_classes = *jtask_classes_ptr;
+        ParseTaskClassLimits(jtask_classes["interactive"], interactive_limits);
+        ParseTaskClassLimits(jtask_classes["subtile"], subtile_limits);
+    }
+    render_pool_.SetClassLimits(TaskClass::interactive, interactive_limits);
+    subtile_pool_.SetClassLimits(TaskClass::subtile, subtile_limits);
+    std::shared_ptr<const Json::Value> jaffinity_queue_depth_ptr = config.GetValue("render/affinity_queue_depth");
+    if (jaffinity_queue_depth_ptr) {
+        render_pool_.SetAffinityQueueDepth(FromJson<uint>(*jaffinity_queue_depth_ptr, 1u));
+    }
+
     for (uint i = 0; i < num_workers; ++i) {
-        auto render_worker = std::make_unique<RenderWorker>(styles);
+        auto render_worker = std::make_unique<RenderWorker>(*encoder_, buffer_pool, style_set_, layer_cache_);
         render_pool_.PushWorker(std::move(render_worker));
     }
 
-    // Check if we already have style updates
-    inited_ = true;
-    TryProcessStyleUpdate();
+    std::shared_ptr<const Json::Value> jsubtile_workers_ptr = config.GetValue("render/subtile_workers");
+    uint num_subtile_workers = std::thread::hardware_concurrency();
+    if (jsubtile_workers_ptr && jsubtile_workers_ptr->isIntegral()) {
+        num_subtile_workers = jsubtile_workers_ptr->asUInt();
+    }
+    for (uint i = 0; i < std::max(num_subtile_workers, 1u); ++i) {
+        subtile_pool_.PushWorker(std::make_unique<SubtileWorker>());
+    }
+
+    // Updates which came during the initialization are applied right away
+    update_thread_ = std::thread(&RenderManager::UpdateLoop, this);
+}
+
+RenderManager::~RenderManager() {
+    {
+        std::lock_guard<std::mutex> lock(update_mux_);
+        stop_updates_ = true;
+    }
+    update_cv_.notify_one();
+    update_thread_.join();
+}
+
+// Renders with equal keys produce the same metatile. Renders started before a style update are not joined after
+// it, they may use the previous styles.
+static std::string MakeRenderKey(const RenderRequest& request, std::uint64_t style_commit) {
+    const MetatileId& metatile_id = request.metatile_id;
+    const TileId& left_top = metatile_id.left_top();
+    std::string key = request.style_name;
+    key.append("@").append(std::to_string(style_commit))
+       .append("/").append(std::to_string(left_top.z))
+       .append("/").append(std::to_string(left_top.x))
+       .append("/").append(std::to_string(left_top.y))
+       .append("/").append(std::to_string(metatile_id.width()))
+       .append("x").append(std::to_string(metatile_id.height()))
+       .append(request.retina ? "/retina" : "/")
+       .append("/").append(std::to_string(static_cast<int>(request.render_type)))
+       .append("/").append(request.utfgrid_key)
+       .append("/").append(request.data_provider)
+       .append("/").append(request.data_version);
+    if (request.data_tile) {
+        const TileId& data_tile_id = request.data_tile->id;
+        key.append("/").append(std::to_string(data_tile_id.z))
+           .append("/").append(std::to_string(data_tile_id.x))
+           .append("/").append(std::to_string(data_tile_id.y));
+    }
+    if (request.layers) {
+        for (const std::string& layer : *request.layers) {
+            key.append("/").append(layer);
+        }
+    }
+    return key;
+}
+
+// Renders of the same style in the same area get equal keys, so they go to the worker whose mapnik caches
+// (markers, fonts) are already warm for them
+static std::size_t MakeAffinityKey(const RenderRequest& request) {
+    // Area of 32x32 tiles
+    static const uint kAreaShift = 5;
+    const TileId& left_top = request.metatile_id.left_top();
+    std::size_t key = std::hash<std::string>()(request.style_name);
+    for (uint value : {left_top.z, left_top.x >> kAreaShift, left_top.y >> kAreaShift}) {
+        key ^= std::hash<uint>()(value) + 0x9e3779b9 + (key << 6) + (key >> 2);
+    }
+    // Zero means no affinity
+    return key ? key : 1;
+}
+
+static void DeliverTile(const TileId& tile_id, const Metatile& metatile, RenderTask& task) {
+    for (const Tile& tile : metatile.tiles) {
+        if (tile.id == tile_id) {
+            Metatile tile_metatile{MetatileId(tile_id)};
+            tile_metatile.tiles.front().data = tile.data;
+            task.SetResult(std::move(tile_metatile));
+            return;
+        }
+    }
+    LOG(ERROR) << "Requested tile not found in metatile! " << tile_id;
+    task.NotifyError(RenderError::internal_error);
 }
 
 std::shared_ptr<RenderTask> RenderManager::Render(std::unique_ptr<RenderRequest> request,
                                                   std::function<void (render_result_t&&)> success_callback,
-                                                  std::function<void ()> error_callback) {
+                                                  std::function<void (RenderError)> error_callback,
+                                                  std::shared_ptr<RenderTask> metatile_task,
+                                                  std::chrono::steady_clock::time_point deadline) {
     assert(request);
     auto task = std::make_shared<RenderTask>(std::move(success_callback), std::move(error_callback), true);
     if (!has_style(request->style_name)) {
-        task->NotifyError();
+        task->NotifyError(RenderError::internal_error);
+        if (metatile_task) {
+            metatile_task->NotifyError(RenderError::internal_error);
+        }
+        return task;
+    }
+    if (request->requested_tile_first && !request->metatile_id.contains(request->tile_id)) {
+        LOG(ERROR) << "Requested tile is out of metatile! " << request->tile_id;
+        request->requested_tile_first = false;
+    }
+    if (!request->requested_tile_first && metatile_task) {
+        metatile_task->NotifyError(RenderError::internal_error);
+        metatile_task.reset();
+    }
+    if (coalesce_renders_) {
+        return RenderCoalesced(std::move(request), std::move(task), std::move(metatile_task), deadline);
+    }
+    if (!CanFinishInTime(EstimateRenderDelay(request->requested_tile_first), deadline)) {
+        task->NotifyError(RenderError::overloaded);
+        if (metatile_task) {
+            metatile_task->NotifyError(RenderError::overloaded);
+        }
         return task;
     }
-    render_pool_.PostTask(TileWorkTask{task, std::move(request)});
+    const std::size_t affinity_key = MakeAffinityKey(*request);
+    render_pool_.PostTask(TileWorkTask{task, std::move(request), std::move(metatile_task), deadline},
+                          TaskClass::interactive, affinity_key);
     return task;
 }
 
+std::shared_ptr<RenderTask> RenderManager::RenderCoalesced(std::unique_ptr<RenderRequest> request,
+                                                           std::shared_ptr<RenderTask> task,
+                                                           std::shared_ptr<RenderTask> metatile_task,
+                                                           std::chrono::steady_clock::time_point deadline) {
+    // Lost renders (e.g. dropped from the queue) are never finished, so stale entries are replaced
+    static const auto kInflightRenderTimeout = std::chrono::seconds(30);
+
+    const bool requested_tile_first = request->requested_tile_first;
+    const std::size_t affinity_key = MakeAffinityKey(*request);
+    std::string key = MakeRenderKey(*request, style_set_.commit_count());
+    auto inflight = std::make_shared<InflightRender>();
+    {
+        const auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(inflight_mux_);
+        auto inflight_itr = inflight_renders_.find(key);
+        if (inflight_itr != inflight_renders_.end() &&
+                now - inflight_itr->second->start_time < kInflightRenderTimeout) {
+            // Joining a render in progress costs nothing, so it is never rejected
+            inflight_itr->second->waiters.push_back(
+                        RenderWaiter{request->tile_id, task, std::move(metatile_task), requested_tile_first, deadline});
+            return task;
+        }
+        if (!CanFinishInTime(EstimateRenderDelay(requested_tile_first), deadline)) {
+            task->NotifyError(RenderError::overloaded);
+            if (metatile_task) {
+                metatile_task->NotifyError(RenderError::overloaded);
+            }
+            return task;
+        }
+        inflight->start_time = now;
+        inflight->waiters.push_back(RenderWaiter{request->tile_id, task, metatile_task, requested_tile_first,
+                                                 deadline});
+        inflight_renders_[key] = inflight;
+    }
+
+    // Shared result is delivered on a worker thread, waiters' tasks pass it to their own threads
+    auto abandoned = [this, key, inflight] {
+        return CheckInflightAbandoned(key, inflight);
+    };
+    std::function<bool ()> metatile_skipped = abandoned;
+    if (requested_tile_first) {
+        metatile_skipped = [this, key, inflight] {
+            return CheckMetatileSkipped(key, inflight);
+        };
+    }
+    auto shared_task = std::make_shared<CoalescedRenderTask>([this, key, inflight](Metatile&& metatile) {
+        std::vector<RenderWaiter> waiters = FinishInflightRender(key, inflight);
+        for (std::size_t i = 0; i < waiters.size(); ++i) {
+            RenderWaiter& waiter = waiters[i];
+            const bool last = i + 1 == waiters.size();
+            if (waiter.requested_tile_first) {
+                // Leader may have already got its tile
+                if (!waiter.task->finished()) {
+                    DeliverTile(waiter.tile_id, metatile, *waiter.task);
+                }
+                if (waiter.metatile_task) {
+                    waiter.metatile_task->SetResult(last ? std::move(metatile) : Metatile(metatile));
+                }
+            } else if (!waiter.task->finished()) {
+                waiter.task->SetResult(last ? std::move(metatile) : Metatile(metatile));
+            }
+        }
+    }, [this, key, inflight](RenderError error) {
+        for (RenderWaiter& waiter : FinishInflightRender(key, inflight)) {
+            waiter.task->NotifyError(error);
+            if (waiter.metatile_task) {
+                waiter.metatile_task->NotifyError(error);
+            }
+        }
+    }, std::move(metatile_skipped));
+
+    // Waiters joining later may have later deadlines, so deadlines are checked per waiter, see
+    // CheckInflightAbandoned
+    const auto render_deadline = std::chrono::steady_clock::time_point::max();
+    if (requested_tile_first) {
+        // Whole metatile is encoded only if followers or the leader's metatile task wait for it
+        auto tile_task = std::make_shared<CoalescedRenderTask>([task](Metatile&& metatile) {
+            task->SetResult(std::move(metatile));
+        }, [task](RenderError error) {
+            task->NotifyError(error);
+        }, std::move(abandoned));
+        render_pool_.PostTask(TileWorkTask{std::move(tile_task), std::move(request), std::move(shared_task),
+                                           render_deadline}, TaskClass::interactive, affinity_key);
+    } else {
+        render_pool_.PostTask(TileWorkTask{std::move(shared_task), std::move(request), nullptr, render_deadline},
+                              TaskClass::interactive, affinity_key);
+    }
+    return task;
+}
+
+bool RenderManager::CanFinishInTime(std::chrono::nanoseconds delay,
+                                    std::chrono::steady_clock::time_point deadline) const {
+    if (deadline == std::chrono::steady_clock::time_point::max()) {
+        return true;
+    }
+    return std::chrono::steady_clock::now() + delay <= deadline;
+}
+
+std::chrono::nanoseconds RenderManager::EstimateRenderDelay(bool requested_tile_first) const {
+    const std::chrono::nanoseconds render_delay = render_pool_.EstimateDelay(TaskClass::interactive);
+    return requested_tile_first ? render_delay : render_delay + encoder_->EstimateDelay();
+}
+
+std::chrono::milliseconds RenderManager::EstimateRenderDelay() const {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(EstimateRenderDelay(false));
+}
+
+std::vector<RenderManager::RenderWaiter> RenderManager::FinishInflightRender(
+        const std::string& key, const std::shared_ptr<InflightRender>& inflight) {
+    std::lock_guard<std::mutex> lock(inflight_mux_);
+    auto inflight_itr = inflight_renders_.find(key);
+    // Entry could have been replaced by a newer render
+    if (inflight_itr != inflight_renders_.end() && inflight_itr->second == inflight) {
+        inflight_renders_.erase(inflight_itr);
+    }
+    return std::move(inflight->waiters);
+}
+
+bool RenderManager::CheckInflightAbandoned(const std::string& key,
+                                           const std::shared_ptr<InflightRender>& inflight) {
+    const auto now = std::chrono::steady_clock::now();
+    std::vector<RenderWaiter> expired;
+    std::vector<RenderWaiter> waiters;
+    bool abandoned = true;
+    {
+        std::lock_guard<std::mutex> lock(inflight_mux_);
+        if (inflight->abandoned) {
+            return true;
+        }
+        // Render goes on for the waiters which still have time
+        auto expired_itr = std::stable_partition(inflight->waiters.begin(), inflight->waiters.end(),
+                                                 [now](const RenderWaiter& waiter) {
+                                                     return now <= waiter.deadline;
+                                                 });
+        std::move(expired_itr, inflight->waiters.end(), std::back_inserter(expired));
+        inflight->waiters.erase(expired_itr, inflight->waiters.end());
+        for (const RenderWaiter& waiter : inflight->waiters) {
+            if (!waiter.task->cancelled()) {
+                abandoned = false;
+                break;
+            }
+        }
+        if (abandoned) {
+            inflight->abandoned = true;
+            // New requests for the metatile must not join the abandoned render
+            auto inflight_itr = inflight_renders_.find(key);
+            if (inflight_itr != inflight_renders_.end() && inflight_itr->second == inflight) {
+                inflight_renders_.erase(inflight_itr);
+            }
+            waiters.swap(inflight->waiters);
+        }
+    }
+    for (RenderWaiter& waiter : expired) {
+        waiter.task->NotifyError(RenderError::deadline_exceeded);
+        if (waiter.metatile_task) {
+            waiter.metatile_task->NotifyError(RenderError::deadline_exceeded);
+        }
+    }
+    for (RenderWaiter& waiter : waiters) {
+        if (waiter.metatile_task) {
+            waiter.metatile_task->NotifyError(RenderError::internal_error);
+        }
+    }
+    return abandoned;
+}
+
+bool RenderManager::CheckMetatileSkipped(const std::string& key, const std::shared_ptr<InflightRender>& inflight) {
+    if (CheckInflightAbandoned(key, inflight)) {
+        return true;
+    }
+    std::lock_guard<std::mutex> lock(inflight_mux_);
+    if (inflight->metatile_skipped) {
+        return true;
+    }
+    if (inflight->waiters.size() > 1 || (!inflight->waiters.empty() && inflight->waiters.front().metatile_task)) {
+        return false;
+    }
+    inflight->metatile_skipped = true;
+    // Requests for other tiles of the metatile must not join the render which does not encode them
+    auto inflight_itr = inflight_renders_.find(key);
+    if (inflight_itr != inflight_renders_.end() && inflight_itr->second == inflight) {
+        inflight_renders_.erase(inflight_itr);
+    }
+    return true;
+}
+
 bool RenderManager::RenderSync(std::unique_ptr<RenderRequest>, render_result_t& output) {
     // TODO
     return false;
@@ -128,87 +587,97 @@ bool RenderManager::RenderSync(std::unique_ptr<RenderRequest>, render_result_t&
 
 std::shared_ptr<RenderTask> RenderManager::MakeSubtile(std::unique_ptr<SubtileRequest> request,
                                                        std::function<void (render_result_t&&)> success_callback,
-                                                       std::function<void ()> error_callback) {
+                                                       std::function<void (RenderError)> error_callback,
+                                                       std::chrono::steady_clock::time_point deadline) {
     assert(request);
     auto task = std::make_shared<RenderTask>(std::move(success_callback), std::move(error_callback), true);
     if (!(request->mvt_tile.id.Valid() && request->tile_id.Valid())) {
         LOG(ERROR) << "Invalid tile id!";
-        task->NotifyError();
+        task->NotifyError(RenderError::internal_error);
+        return task;
+    }
+    if (!CanFinishInTime(subtile_pool_.EstimateDelay(TaskClass::subtile), deadline)) {
+        task->NotifyError(RenderError::overloaded);
         return task;
     }
-    render_pool_.PostTask(TileWorkTask{task, std::move(request)});
+    subtile_pool_.PostTask(TileWorkTask{task, std::move(request), nullptr, deadline}, TaskClass::subtile);
     return task;
 }
 
+void RenderManager::InvalidateData(const std::string& provider_name, const std::string& version) {
+    if (layer_cache_) {
+        layer_cache_->Invalidate(provider_name, version);
+    }
+}
+
 void RenderManager::PostStyleUpdate(std::shared_ptr<const Json::Value> jstyles) {
     assert(jstyles);
-    std::atomic_store(&styles_update_, std::move(jstyles));
-    TryProcessStyleUpdate();
+    {
+        std::lock_guard<std::mutex> lock(update_mux_);
+        styles_update_ = std::move(jstyles);
+    }
+    update_cv_.notify_one();
 }
 
-void RenderManager::TryProcessStyleUpdate() {
-    if (!inited_ || !std::atomic_load(&styles_update_)) {
-        return;
+void RenderManager::UpdateLoop() {
+    std::unique_lock<std::mutex> lock(update_mux_);
+    while (true) {
+        update_cv_.wait(lock, [this] { return stop_updates_ || styles_update_; });
+        if (stop_updates_) {
+            return;
+        }
+        std::shared_ptr<const Json::Value> jstyles = std::move(styles_update_);
+        styles_update_.reset();
+        lock.unlock();
+        ProcessStyleUpdate(*jstyles);
+        lock.lock();
     }
-    bool expected = false;
-    if (!updating_.compare_exchange_strong(expected, true)) {
+}
+
+void RenderManager::ProcessStyleUpdate(const Json::Value& jstyles) {
+    std::vector<StyleInfo> update;
+    if (!ParseStyles(jstyles, update)) {
         return;
     }
-    std::shared_ptr<const Json::Value> jstyles = std::atomic_exchange(&styles_update_,
-                                                                      std::shared_ptr<const Json::Value>());
-    if (!jstyles || !ParseStyles(*jstyles, pending_update_)) {
-        FinishUpdate();
+    auto style_map = LoadEagerStyles(update, false);
+    if (!style_map || !style_set_.UpdateStyles(style_map, update)) {
+        LOG(ERROR) << "Error loading styles. Cancelling update!";
         return;
     }
-
-    workers_to_update_ = render_pool_.Workers();
-    if (workers_to_update_.empty()) {
-        LOG(WARNING) << "Render pool has no workers! Skipping update!";
+    // All workers switch to the new styles at once
+    style_set_.CommitUpdate(style_map.get());
+    auto new_style_names = std::make_shared<std::unordered_set<std::string>>();
+    for (const StyleInfo& style_info : update) {
+        new_style_names->insert(style_info.name);
     }
-    render_pool_.ExecuteOnWorker(std::bind(&RenderManager::UpdateWorker, this, std::placeholders::_1),
-                                 workers_to_update_.back());
+    std::atomic_store(&style_names_, std::move(new_style_names));
 }
 
-void RenderManager::UpdateWorker(RenderWorker& worker) {
-    if (!worker.UpdateStyles(pending_update_)) {
-        LOG(ERROR) << "Error updating worker " << workers_to_update_.size() << ". Cancelling update!";
-        const auto* pending_update_ptr = &pending_update_;
-        for (const RenderWorker* rw : updated_workers_) {
-            render_pool_.ExecuteOnWorker([pending_update_ptr](RenderWorker& wrk) {
-                wrk.CancelUpdate(pending_update_ptr);
-            }, rw);
+std::shared_ptr<const style_map_t> RenderManager::LoadEagerStyles(const std::vector<StyleInfo>& styles,
+                                                                  bool skip_failed) {
+    std::shared_ptr<const style_map_t> current_styles = style_set_.styles();
+    if (!style_set_.lazy_loading()) {
+        return LoadStyles(styles, current_styles.get(), skip_failed, style_snapshot_dir_);
+    }
+    std::vector<StyleInfo> pinned_styles;
+    for (const StyleInfo& style_info : styles) {
+        if (style_set_.pinned(style_info.name)) {
+            pinned_styles.push_back(style_info);
         }
-        FinishUpdate();
-    } else {
-        updated_workers_.push_back(workers_to_update_.back());
-        workers_to_update_.pop_back();
-        if (workers_to_update_.empty()) {
-            // All workers updated
-            const auto* pending_update_ptr = &pending_update_;
-            for (const RenderWorker* rw : updated_workers_) {
-                render_pool_.ExecuteOnWorker([pending_update_ptr](RenderWorker& wrk) {
-                    wrk.CommitUpdate(pending_update_ptr);
-                }, rw);
-            }
-            // Update style names set
-            auto new_style_names = std::make_shared<std::unordered_set<std::string>>();
-            for (const StyleInfo& style_info : pending_update_) {
-                new_style_names->insert(style_info.name);
+    }
+    auto loaded_styles = LoadStyles(pinned_styles, current_styles.get(), skip_failed, style_snapshot_dir_);
+    if (!loaded_styles) {
+        return nullptr;
+    }
+    auto style_map = std::make_shared<style_map_t>(*loaded_styles);
+    // Loaded styles stay until they are evicted, unless their versions are changed
+    if (current_styles) {
+        for (const StyleInfo& style_info : styles) {
+            auto style_itr = current_styles->find(style_info.name);
+            if (style_itr != current_styles->end() && style_itr->second->version() == style_info.version) {
+                style_map->emplace(style_info.name, style_itr->second);
             }
-            std::atomic_store(&style_names_, std::move(new_style_names));
-            FinishUpdate();
-        } else {
-            // Update next worker
-            render_pool_.ExecuteOnWorker(std::bind(&RenderManager::UpdateWorker, this, std::placeholders::_1),
-                                         workers_to_update_.back());
         }
     }
-}
-
-void RenderManager::FinishUpdate() {
-    workers_to_update_.clear();
-    updated_workers_.clear();
-    pending_update_.clear();
-    updating_ = false;
-    TryProcessStyleUpdate();
+    return style_map;
 }
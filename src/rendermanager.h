@@ -1,10 +1,18 @@
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
 
 #include "config.h"
+#include "metatile_encoder.h"
+#include "render_buffer_pool.h"
 #include "renderworker.h"
+#include "subtile_worker.h"
 #include "thread_pool.h"
 
 class RenderManager;
@@ -23,20 +31,42 @@ using render_result_t = Metatile&&;
 class RenderManager {
 public:
     RenderManager(Config& config);
+    ~RenderManager();
 
     // If this method is called from event base thread, callbacks will be called in this thread too.
+    // In requested tile first mode success callback receives only the requested tile and the whole metatile
+    // is delivered into metatile_task afterwards (if provided).
+    // Concurrent requests for the same metatile share one render.
+    // Request which is not expected to finish before the deadline is rejected with RenderError::overloaded.
     std::shared_ptr<RenderTask> Render(std::unique_ptr<RenderRequest> request,
                                        std::function<void(render_result_t&&)> success_callback,
-                                       std::function<void()> error_callback = std::function<void()>());
+                                       std::function<void(RenderError)> error_callback = nullptr,
+                                       std::shared_ptr<RenderTask> metatile_task = nullptr,
+                                       std::chrono::steady_clock::time_point deadline =
+                                               std::chrono::steady_clock::time_point::max());
 
     bool RenderSync(std::unique_ptr<RenderRequest>, render_result_t& output);
 
     std::shared_ptr<RenderTask> MakeSubtile(std::unique_ptr<SubtileRequest> request,
                                             std::function<void(render_result_t&&)> success_callback,
-                                            std::function<void()> error_callback = std::function<void()>());
+                                            std::function<void(RenderError)> error_callback = nullptr,
+                                            std::chrono::steady_clock::time_point deadline =
+                                                    std::chrono::steady_clock::time_point::max());
+
+    // Expected time until a render posted now is finished, encoding of the whole metatile included
+    std::chrono::milliseconds EstimateRenderDelay() const;
+
+    // How often renders land on the worker which rendered the same style and area last
+    inline ThreadPool<RenderWorker, TileWorkTask>::AffinityStats render_affinity_stats() const noexcept {
+        return render_pool_.affinity_stats();
+    }
 
     void PostStyleUpdate(std::shared_ptr<const Json::Value> jstyles);
 
+    // Drops decoded layers of the provider's data tiles when the data of the version is reloaded. Empty version
+    // means every version.
+    void InvalidateData(const std::string& provider_name, const std::string& version);
+
     inline bool has_style(const std::string& style_name) {
         auto style_names = std::atomic_load(&style_names_);
         return style_names->find(style_name) != style_names->end();
@@ -44,20 +74,67 @@ public:
 
 
 private:
-    void TryProcessStyleUpdate();
-    void UpdateWorker(RenderWorker& worker);
-    void FinishUpdate();
+    struct RenderWaiter {
+        TileId tile_id;
+        std::shared_ptr<RenderTask> task;
+        std::shared_ptr<RenderTask> metatile_task;
+        bool requested_tile_first;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    struct InflightRender {
+        std::chrono::steady_clock::time_point start_time;
+        std::vector<RenderWaiter> waiters;
+        // Set once all waiters have gone, render is not finished then
+        bool abandoned{false};
+        // Set if the rest of the metatile is not encoded, only the leader's tile is delivered then
+        bool metatile_skipped{false};
+    };
+
+    std::shared_ptr<RenderTask> RenderCoalesced(std::unique_ptr<RenderRequest> request,
+                                                std::shared_ptr<RenderTask> task,
+                                                std::shared_ptr<RenderTask> metatile_task,
+                                                std::chrono::steady_clock::time_point deadline);
+    std::vector<RenderWaiter> FinishInflightRender(const std::string& key,
+                                                   const std::shared_ptr<InflightRender>& inflight);
+    // Returns true if nobody waits for the render anymore. Waiters past their deadline are rejected.
+    bool CheckInflightAbandoned(const std::string& key, const std::shared_ptr<InflightRender>& inflight);
+    // Returns true if nobody but the leader waits for the render and the leader needs only its tile
+    bool CheckMetatileSkipped(const std::string& key, const std::shared_ptr<InflightRender>& inflight);
+
+    // Requested tile is encoded by the render worker, the whole metatile waits for the encoder pool
+    std::chrono::nanoseconds EstimateRenderDelay(bool requested_tile_first) const;
+    bool CanFinishInTime(std::chrono::nanoseconds delay, std::chrono::steady_clock::time_point deadline) const;
+
+    // Styles are loaded on the update thread, so an update neither blocks the caller nor takes a render worker
+    void UpdateLoop();
+    void ProcessStyleUpdate(const Json::Value& jstyles);
+    // Loads styles which are not loaded lazily
+    std::shared_ptr<const style_map_t> LoadEagerStyles(const std::vector<StyleInfo>& styles, bool skip_failed);
 
     using render_pool_t = ThreadPool<RenderWorker, TileWorkTask>;
+    // Inflight renders are finished on encoder threads, so they must outlive the pools
+    std::unordered_map<std::string, std::shared_ptr<InflightRender>> inflight_renders_;
+    std::mutex inflight_mux_;
+    bool coalesce_renders_{true};
+    // Encoder and styles must outlive render workers
+    std::unique_ptr<MetatileEncoder> encoder_;
+    StyleSet style_set_;
+    // Decoded data tile layers shared by render workers
+    std::shared_ptr<MvtLayerCache> layer_cache_;
     render_pool_t render_pool_;
+    // Subtiles do not wait behind metatile renders
+    ThreadPool<SubtileWorker, TileWorkTask> subtile_pool_;
     std::shared_ptr<std::unordered_set<std::string>> style_names_;
 
+    // Converted styles are cached there if set
+    std::string style_snapshot_dir_;
+    // Only the latest update is applied if several come while styles are loaded
     std::shared_ptr<const Json::Value> styles_update_;
-    std::vector<StyleInfo> pending_update_;
-    std::vector<const RenderWorker*> workers_to_update_;
-    std::vector<const RenderWorker*> updated_workers_;
-    std::atomic_bool updating_{false};
-    std::atomic_bool inited_{false};
+    bool stop_updates_{false};
+    std::mutex update_mux_;
+    std::condition_variable update_cv_;
+    std::thread update_thread_;
 
     StyleUpdateObserver update_observer_;
 
@@ -1,13 +1,13 @@
 #pragma once
 
+#include <chrono>
 #include <list>
 #include <set>
 #include <string>
 
-#include <mapnik/map.hpp>
-
 #include "async_task.h"
 #include "filter_table.h"
+#include "render_style.h"
 #include "tile.h"
 #include "worker.h"
 
@@ -24,15 +24,22 @@ struct RenderRequest : public TileWorkRequest {
 
     RenderRequest() = default;
 
-    RenderRequest(MetatileId _metatile_id) : metatile_id(_metatile_id) {}
+    RenderRequest(const TileId& _tile_id) : metatile_id(_tile_id), tile_id(_tile_id) {}
 
     MetatileId metatile_id;
+    // Tile which was actually requested by the client
+    TileId tile_id;
     std::string style_name;
     std::string utfgrid_key;
     std::shared_ptr<Tile> data_tile;
+    // Identify data_tile contents
+    std::string data_provider;
+    std::string data_version;
     std::unique_ptr<std::set<std::string>> layers;
     RenderType render_type{RenderType::png};
     bool retina{false};
+    // Deliver requested tile as soon as it is encoded, the rest of the metatile is delivered separately
+    bool requested_tile_first{false};
 };
 
 struct SubtileRequest : public TileWorkRequest {
@@ -49,62 +56,44 @@ struct SubtileRequest : public TileWorkRequest {
     std::unique_ptr<std::set<std::string>> layers;
 };
 
-using RenderTask = AsyncTask<Metatile&&>;
+enum class RenderError : std::uint8_t {
+    internal_error,
+    // Rejected because the request could not be finished before its deadline
+    overloaded,
+    // Deadline passed before processing started
+    deadline_exceeded
+};
+
+using RenderTask = AsyncTask<Metatile&&, RenderError>;
 
 struct TileWorkTask {
     std::shared_ptr<RenderTask> async_task;
     std::unique_ptr<TileWorkRequest> request;
+    // Receives the whole metatile if only the requested tile is delivered into async_task
+    std::shared_ptr<RenderTask> metatile_task;
+    // Task is not processed after the deadline
+    std::chrono::steady_clock::time_point deadline{std::chrono::steady_clock::time_point::max()};
 };
 
-struct StyleInfo {
-    enum class Type : std::uint8_t {
-        mapnik,
-        mvt
-    };
-
-    std::string name;
-    std::string path;
-    std::string base_path;
-    std::shared_ptr<std::string> data;
-    uint version{0};
-    Type type{Type::mapnik};
-    bool allow_grid_render{false};
-};
-
+class MetatileEncoder;
+class MvtLayerCache;
+class RenderBufferPool;
 
 class RenderWorker : public Worker<TileWorkTask> {
 public:
-    using styles_t = std::vector<StyleInfo>;
-
-    RenderWorker(std::shared_ptr<const styles_t> styles = nullptr);
+    // Style set is shared with other workers and must outlive the worker. Layer cache is optional.
+    RenderWorker(MetatileEncoder& encoder, std::shared_ptr<RenderBufferPool> buffer_pool, StyleSet& styles,
+                 std::shared_ptr<MvtLayerCache> layer_cache = nullptr);
 
-    bool Init() noexcept override;
     virtual void ProcessTask(TileWorkTask task) noexcept override;
 
-    static void CalculateLayersSD(mapnik::Map& map);
-
-    bool UpdateStyles(const styles_t& styles);
-    bool CommitUpdate(const styles_t* update_ptr);
-    bool CancelUpdate(const styles_t* update_ptr);
-
 private:
-    struct MapInfo {
-        MapInfo(int width, int height, std::string const& srs) : map(width, height, srs) {}
-
-        mapnik::Map map;
-        std::vector<mapnik::layer*> mvt_layers;
-        std::vector<mapnik::layer*> standard_layers;
-        uint version{0};
-        bool allow_grid_render{false};
-    };
-
-    std::shared_ptr<MapInfo> LoadStyle(const StyleInfo& style_info);
-    void ProcessRender(RenderTask& async_task, const RenderRequest& render_request) noexcept;
-    void ProcessSubtile(RenderTask& async_task, SubtileRequest& subtile_request) noexcept;
-
-    std::unordered_map<std::string, std::shared_ptr<MapInfo>> maps_;
-    std::unordered_map<std::string, std::shared_ptr<MapInfo>> updated_maps_;
-    std::shared_ptr<const styles_t> styles_;
-    const styles_t* pending_update_ptr_{nullptr};
+    void ProcessRender(const std::shared_ptr<RenderTask>& async_task, const std::shared_ptr<RenderTask>& metatile_task,
+                       const RenderRequest& render_request) noexcept;
+
+    StyleSet& styles_;
+    MetatileEncoder& encoder_;
+    std::shared_ptr<RenderBufferPool> buffer_pool_;
+    std::shared_ptr<MvtLayerCache> layer_cache_;
 
 };
@@ -0,0 +1,31 @@
+#include "stats_handler.h"
+
+#include <string>
+
+#include <proxygen/httpserver/ResponseBuilder.h>
+
+
+StatsHandler::StatsHandler(const RenderManager& render_manager, const DataManager& data_manager) :
+        render_manager_(render_manager),
+        data_manager_(data_manager) { }
+
+void StatsHandler::onRequest(std::unique_ptr<proxygen::HTTPMessage> headers) noexcept {
+    const auto affinity_stats = render_manager_.render_affinity_stats();
+    const auto tile_cache_stats = data_manager_.tile_cache_stats();
+    std::string stats = "{\"render_affinity\":{\"hits\":" + std::to_string(affinity_stats.hits) +
+                        ",\"misses\":" + std::to_string(affinity_stats.misses) + "}" +
+                        ",\"data_tile_cache\":{\"hits\":" + std::to_string(tile_cache_stats.hits) +
+                        ",\"misses\":" + std::to_string(tile_cache_stats.misses) +
+                        ",\"bytes\":" + std::to_string(tile_cache_stats.bytes) +
+                        ",\"max_bytes\":" + std::to_string(tile_cache_stats.max_bytes) + "}}";
+    proxygen::ResponseBuilder rb(downstream_);
+    rb.status(200, "OK");
+    rb.header("Content-Type", "application/json");
+    rb.header("Cache-Control", "no-cache");
+    rb.body(folly::IOBuf::copyBuffer(stats));
+    rb.sendWithEOM();
+}
+
+void StatsHandler::onBody(std::unique_ptr<folly::IOBuf> body) noexcept { }
+
+void StatsHandler::onSuccessEOM() noexcept { }
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "base_handler.h"
+#include "data_manager.h"
+#include "rendermanager.h"
+
+// Reports internal counters as JSON
+class StatsHandler : public BaseHandler {
+public:
+    StatsHandler(const RenderManager& render_manager, const DataManager& data_manager);
+
+    void onRequest(std::unique_ptr<proxygen::HTTPMessage> headers) noexcept override;
+    void onBody(std::unique_ptr<folly::IOBuf> body) noexcept override;
+    void onSuccessEOM() noexcept override;
+
+private:
+    const RenderManager& render_manager_;
+    const DataManager& data_manager_;
+};
@@ -0,0 +1,37 @@
+#include "subtile_worker.h"
+
+#include <glog/logging.h>
+
+#include "subtiler.h"
+
+
+void SubtileWorker::ProcessTask(TileWorkTask task) noexcept {
+    RenderTask& async_task = *task.async_task;
+    if (async_task.cancelled()) {
+        return;
+    }
+    if (std::chrono::steady_clock::now() > task.deadline) {
+        async_task.NotifyError(RenderError::deadline_exceeded);
+        return;
+    }
+    SubtileRequest* request = dynamic_cast<SubtileRequest*>(task.request.get());
+    if (!request) {
+        LOG(ERROR) << "Invalid TileWorkRequest!";
+        async_task.NotifyError(RenderError::internal_error);
+        return;
+    }
+    const int buf_size = 256;
+    Subtiler subtiler(std::move(request->mvt_tile), request->filter_table);
+    std::string result;
+    try {
+        result = subtiler.MakeSubtile(request->tile_id, 4096, buf_size, std::move(request->layers));
+    } catch (...) {
+        LOG(ERROR) << "MVT subtiling error: " << request->tile_id;
+        async_task.NotifyError(RenderError::internal_error);
+        return;
+    }
+    Metatile metatile;
+    metatile.id = MetatileId(request->tile_id);
+    metatile.tiles.push_back(Tile{request->tile_id, std::move(result)});
+    async_task.SetResult(std::move(metatile));
+}
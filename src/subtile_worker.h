@@ -0,0 +1,10 @@
+#pragma once
+
+#include "renderworker.h"
+
+
+// Cuts MVT subtiles. Unlike RenderWorker it does not need any styles loaded.
+class SubtileWorker : public Worker<TileWorkTask> {
+public:
+    void ProcessTask(TileWorkTask task) noexcept override;
+};
@@ -41,7 +41,8 @@ std::string Subtiler::MakeSubtile(const TileId& target_tile_id,
 
 //    result.reserve(tile_data_.size() / zoom_factor);
 
-    protozero::pbf_reader tile_message(base_tile_.data);
+    const auto tile_bytes = base_tile_.bytes();
+    protozero::pbf_reader tile_message(tile_bytes.data(), tile_bytes.size());
     protozero::pbf_writer result_pbf(result);
 
     // loop through the layers of the tile!
@@ -1,15 +1,42 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <deque>
-#include <list>
 #include <mutex>
 #include <thread>
+#include <vector>
 
 #include "async_task.h"
 #include "worker.h"
 
 
+// Classes are listed in priority order
+enum class TaskClass : std::uint8_t {
+    interactive,
+    subtile,
+    // Prefetch work, processed when no task of higher classes is waiting
+    background
+};
+
+constexpr std::size_t kNumTaskClasses = 3;
+
+struct TaskClassLimits {
+    // Oldest task of the class is dropped when the limit is reached. Zero means no limit.
+    std::size_t queue_limit{0};
+    // Maximum number of tasks of the class processed at once. Zero means no limit.
+    std::size_t max_running{0};
+    // Task which waited longer is processed before tasks of higher classes. Zero disables aging.
+    std::chrono::milliseconds max_wait{0};
+};
+
+// Every worker has its own queues. Tasks are posted to an idle worker if there is one, otherwise to the busy
+// workers in turn. Worker which runs out of tasks steals them from the others before going to sleep.
+// Task with an affinity key goes to the worker which processed a task with the same key last if that worker is
+// idle, or if all workers are busy and its queue is short, so related tasks find the worker's caches warm.
 template <typename Wrk, typename Task>
 class ThreadPool {
     static_assert(std::is_base_of<Worker<Task>, Wrk>::value, "Actual worker have to subclass Worker class!");
@@ -20,14 +47,16 @@ class ThreadPool {
 public:
 
     using worker_t = Wrk;
-    using worker_fn_t = std::function<void(worker_t&)>;
     using task_t = Task;
+    using drop_handler_t = std::function<void(task_t&&)>;
 
     using WorkerInitTask = AsyncTask<worker_t*, worker_t*>;
     using success_init_cb_t = typename WorkerInitTask::result_cb_t;
     using fail_init_cb_t = typename WorkerInitTask::error_cb_t;
 
-    ThreadPool(std::size_t queue_limit = 0) : queue_limit_(queue_limit) { }
+    ThreadPool(std::size_t queue_limit = 0) :
+            workers_(std::make_shared<const workers_vec_t>()),
+            queue_limit_(queue_limit) { }
 
     ThreadPool(const ThreadPool&) = delete;
     ThreadPool& operator=(const ThreadPool&) = delete;
@@ -35,27 +64,54 @@ public:
     ThreadPool& operator=(ThreadPool&&) = delete;
 
     ~ThreadPool() {
-        for (auto& wh : workers_) {
-            wh.stop();
+        std::lock_guard<std::mutex> lock(workers_mutex_);
+        for (auto& wh : *workers_) {
+            wh->stop();
         }
-        wake_all();
-        for (auto& wh : workers_) {
-            wh.join();
+        for (auto& wh : *workers_) {
+            wh->join();
         }
     }
 
 private:
 
-    class WorkerHelper {
+    using clock_t = std::chrono::steady_clock;
+
+    template <typename T>
+    struct Queued {
+        T item;
+        clock_t::time_point enqueue_time;
+        std::size_t affinity_key{0};
+    };
+
+    template <typename T>
+    using class_queues_t = std::array<std::deque<Queued<T>>, kNumTaskClasses>;
+
+    struct TaskQueues {
+        class_queues_t<Task> tasks;
+        std::mutex mux;
+    };
+
+    struct ClassState {
+        std::atomic<std::size_t> queue_limit{0};
+        std::atomic<std::size_t> max_running{0};
+        std::atomic<std::int64_t> max_wait_ms{0};
+        std::atomic<std::size_t> queued{0};
+        std::atomic<std::size_t> running{0};
+        // Moving average of ProcessTask duration
+        std::atomic<std::int64_t> service_time_ns{0};
+    };
+
+    class WorkerHelper : public TaskQueues, public std::enable_shared_from_this<WorkerHelper> {
     public:
-        WorkerHelper(std::unique_ptr<Wrk>&& wrk, std::shared_ptr<WorkerInitTask> init_task, std::deque<Task>& tasks,
-                     std::mutex& mux, std::condition_variable& cv) :
+        WorkerHelper(std::unique_ptr<Wrk>&& wrk, std::shared_ptr<WorkerInitTask> init_task, ThreadPool& pool) :
                 init_task_(std::move(init_task)),
                 worker_(std::move(wrk)),
-                tasks_(tasks),
-                mux_(mux),
-                cv_(cv) {
+                pool_(pool) {
             assert(worker_);
+        }
+
+        inline void start() {
             thread_ = std::thread(&WorkerHelper::Loop, this);
         }
 
@@ -70,33 +126,17 @@ private:
                 init_task_->SetResult(worker_.get());
             }
 
-            Task task;
-            worker_fn_t fn;
-            bool process_task;
+            Queued<Task> queued;
+            std::size_t task_class;
             while (!stop_flag_) {
-                {
-                    std::unique_lock<std::mutex> lock(mux_);
-                    while (!stop_flag_ && functions_.empty() && tasks_.empty()) {
-                        cv_.wait(lock);
-                    }
-                    if (stop_flag_) {
-                        return;
-                    }
-                    if (!functions_.empty()) {
-                        fn = std::move(functions_.front());
-                        functions_.pop_front();
-                        process_task = false;
-                    } else {
-                        task = std::move(tasks_.front());
-                        tasks_.pop_front();
-                        process_task = true;
-                    }
-                }
-                if (process_task) {
-                    worker_->ProcessTask(std::move(task));
-                } else {
-                    fn(*worker_);
+                if (!pool_.TakeWork(*this, queued, task_class)) {
+                    Sleep();
+                    continue;
                 }
+                pool_.CountAffinity(*this, queued.affinity_key);
+                const auto start_time = clock_t::now();
+                worker_->ProcessTask(std::move(queued.item));
+                pool_.FinishRun(task_class, clock_t::now() - start_time);
             }
         }
 
@@ -106,77 +146,146 @@ private:
 
         inline void stop() {
             stop_flag_ = true;
+            Wake();
         }
 
         inline void join() {
-            thread_.join();
+            if (thread_.joinable()) {
+                thread_.join();
+            }
+        }
+
+        inline void Wake() {
+            std::lock_guard<std::mutex> lock(this->mux);
+            woken_ = true;
+            cv_.notify_one();
+        }
+
+        // Should be called under mux
+        inline std::size_t num_tasks() const noexcept {
+            std::size_t count = 0;
+            for (const auto& class_tasks : this->tasks) {
+                count += class_tasks.size();
+            }
+            return count;
         }
 
         std::thread thread_;
-        std::deque<worker_fn_t> functions_;
         std::shared_ptr<WorkerInitTask> init_task_;
         std::unique_ptr<Wrk> worker_;
-        std::deque<Task>& tasks_;
-        std::mutex& mux_;
-        std::condition_variable& cv_;
+        ThreadPool& pool_;
+        std::condition_variable cv_;
+        std::size_t steal_offset_{0};
+        bool woken_{false};
+        bool removed_{false};
+        // Guarded by idle_mutex_ of the pool
+        bool idle_{false};
         std::atomic_bool stop_flag_{false};
+        // Key of the last processed task which had one
+        std::atomic<std::size_t> affinity_key_{0};
+
+    private:
+        void Sleep() {
+            {
+                std::lock_guard<std::mutex> lock(this->mux);
+                woken_ = false;
+            }
+            pool_.PushIdle(this->shared_from_this());
+            // Task could be posted before the worker became visible as idle
+            if (pool_.HasWork()) {
+                pool_.RemoveIdle(this);
+                return;
+            }
+            {
+                std::unique_lock<std::mutex> lock(this->mux);
+                cv_.wait(lock, [this] { return woken_ || stop_flag_; });
+            }
+            pool_.RemoveIdle(this);
+        }
     };
 
+    using workers_vec_t = std::vector<std::shared_ptr<WorkerHelper>>;
+
 public:
 
+    struct AffinityStats {
+        // Tasks processed by the worker which processed the previous task with the same key
+        std::uint64_t hits;
+        std::uint64_t misses;
+    };
+
     inline uint NumWorkers() const {
-        std::lock_guard<std::mutex> lock(workers_mutex_);
-        return workers_.size();
+        return std::atomic_load(&workers_)->size();
     }
 
     std::vector<const worker_t*> Workers() const {
         std::vector<const worker_t*> workers;
-        std::lock_guard<std::mutex> lock(workers_mutex_);
-        workers.reserve(workers_.size());
-        for (const WorkerHelper& wh : workers_) {
-            workers.push_back(wh.worker_ptr());
+        auto workers_snapshot = std::atomic_load(&workers_);
+        workers.reserve(workers_snapshot->size());
+        for (const auto& wh : *workers_snapshot) {
+            workers.push_back(wh->worker_ptr());
         }
         return workers;
     }
 
+    // Limits total number of queued tasks. Tasks of the lowest class are shed first.
     inline void SetQueueLimit(std::size_t queue_limit) {
-        std::lock_guard<std::mutex> lock(queue_mutex_);
         queue_limit_ = queue_limit;
     }
 
-    inline void PostTask(const task_t& task) {
-        PostTaskImpl(task);
+    inline void SetClassLimits(TaskClass task_class, const TaskClassLimits& limits) {
+        ClassState& state = classes_[static_cast<std::size_t>(task_class)];
+        state.queue_limit = limits.queue_limit;
+        state.max_running = limits.max_running;
+        state.max_wait_ms = limits.max_wait.count();
     }
 
-    inline void PostTask(task_t&& task) {
-        PostTaskImpl(std::move(task));
+    // Expected time until a task of the class posted now is processed, based on recent service times
+    std::chrono::nanoseconds EstimateDelay(TaskClass task_class) const {
+        const std::size_t class_idx = static_cast<std::size_t>(task_class);
+        std::int64_t queued_time_ns = 0;
+        for (std::size_t i = 0; i <= class_idx; ++i) {
+            queued_time_ns += static_cast<std::int64_t>(classes_[i].queued) * classes_[i].service_time_ns;
+        }
+        const std::int64_t num_workers = std::max<std::int64_t>(NumWorkers(), 1);
+        return std::chrono::nanoseconds(queued_time_ns / num_workers + classes_[class_idx].service_time_ns);
     }
 
-    bool ExecuteOnWorker(worker_fn_t fn, const worker_t* const worker_ptr) {
-        std::lock_guard<std::mutex> workers_lock(workers_mutex_);
-        for (WorkerHelper& wh : workers_) {
-            if (wh.worker_ptr() == worker_ptr) {
-                std::lock_guard<std::mutex> queue_lock(queue_mutex_);
-                wh.functions_.push_back(std::move(fn));
-                wake_all();
-                return true;
-            }
-        }
-        return false;
+    // Task goes to the idle worker with the same affinity key. If all workers are busy, it is queued behind that
+    // worker unless it has that many tasks queued. Zero disables affinity.
+    inline void SetAffinityQueueDepth(std::size_t max_depth) {
+        affinity_queue_depth_ = max_depth;
+    }
+
+    inline AffinityStats affinity_stats() const noexcept {
+        return AffinityStats{affinity_hits_, affinity_misses_};
+    }
+
+    // Handler is called for every task dropped from the queue
+    inline void SetDropHandler(drop_handler_t drop_handler) {
+        std::lock_guard<std::mutex> lock(drop_handler_mutex_);
+        drop_handler_ = std::move(drop_handler);
+    }
+
+    // Zero affinity key means no preference
+    inline void PostTask(const task_t& task, TaskClass task_class = TaskClass::interactive,
+                         std::size_t affinity_key = 0) {
+        PostTaskImpl(task, task_class, affinity_key);
+    }
+
+    inline void PostTask(task_t&& task, TaskClass task_class = TaskClass::interactive,
+                         std::size_t affinity_key = 0) {
+        PostTaskImpl(std::move(task), task_class, affinity_key);
     }
 
     void PushWorker(std::unique_ptr<worker_t> worker) {
-        assert(worker);
-        std::lock_guard<std::mutex> lock(workers_mutex_);
-        workers_.emplace_back(std::move(worker), nullptr, tasks_, queue_mutex_, cv_);
+        PushWorkerImpl(std::move(worker), nullptr);
     }
 
     std::shared_ptr<WorkerInitTask> PushWorker(std::unique_ptr<Wrk> worker, success_init_cb_t success_init_cb,
                                                fail_init_cb_t fail_init_cb) {
-        assert(worker);
         auto task = std::make_shared<WorkerInitTask>(std::move(success_init_cb), std::move(fail_init_cb), true);
-        std::lock_guard<std::mutex> lock(workers_mutex_);
-        workers_.emplace_back(std::move(worker), task, tasks_, queue_mutex_, cv_);
+        PushWorkerImpl(std::move(worker), task);
         return task;
     }
 
@@ -184,73 +293,383 @@ public:
         if (num_workers == 0) {
             return;
         }
-        std::list<WorkerHelper> wh_to_remove;
+        workers_vec_t wh_to_remove;
         {
             std::lock_guard<std::mutex> lock(workers_mutex_);
-            typename std::list<WorkerHelper>::iterator end_iter;
-            if (num_workers >= workers_.size()) {
-                end_iter = workers_.end();
-            } else {
-                end_iter = workers_.begin() + (num_workers - 1);
-            }
-            wh_to_remove.splice(wh_to_remove.end(), workers_, workers_.begin(), end_iter);
+            auto workers = std::make_shared<workers_vec_t>(*workers_);
+            const std::size_t num_to_remove = std::min<std::size_t>(num_workers, workers->size());
+            wh_to_remove.assign(workers->begin(), workers->begin() + num_to_remove);
+            workers->erase(workers->begin(), workers->begin() + num_to_remove);
+            std::atomic_store(&workers_, std::shared_ptr<const workers_vec_t>(std::move(workers)));
         }
-        for (WorkerHelper& wh : wh_to_remove) {
-            wh.stop();
+        for (auto& wh : wh_to_remove) {
+            wh->stop();
         }
-        wake_all();
-        for (WorkerHelper& wh : wh_to_remove) {
-            wh.join();
+        for (auto& wh : wh_to_remove) {
+            FinishRemoval(*wh);
         }
     }
 
     bool RemoveWorker(worker_t* wrk_ptr) {
-        std::list<WorkerHelper> wh_to_remove;
-        bool found = false;
+        std::shared_ptr<WorkerHelper> wh_to_remove;
         {
             std::lock_guard<std::mutex> lock(workers_mutex_);
-            for (auto wh_itr = workers_.begin(); wh_itr != workers_.end(); ++wh_itr) {
-                if (wh_itr->worker.get() == wrk_ptr) {
-                    wh_to_remove.splice(wh_to_remove.end(), workers_, wh_itr);
-                    found = true;
+            auto workers = std::make_shared<workers_vec_t>(*workers_);
+            for (auto wh_itr = workers->begin(); wh_itr != workers->end(); ++wh_itr) {
+                if ((*wh_itr)->worker_ptr() == wrk_ptr) {
+                    wh_to_remove = std::move(*wh_itr);
+                    workers->erase(wh_itr);
                     break;
                 }
             }
+            if (!wh_to_remove) {
+                return false;
+            }
+            std::atomic_store(&workers_, std::shared_ptr<const workers_vec_t>(std::move(workers)));
+        }
+        wh_to_remove->stop();
+        FinishRemoval(*wh_to_remove);
+        return true;
+    }
+
+
+private:
+    void PushWorkerImpl(std::unique_ptr<worker_t> worker, std::shared_ptr<WorkerInitTask> init_task) {
+        assert(worker);
+        auto wh = std::make_shared<WorkerHelper>(std::move(worker), std::move(init_task), *this);
+        {
+            std::lock_guard<std::mutex> lock(workers_mutex_);
+            auto workers = std::make_shared<workers_vec_t>(*workers_);
+            workers->push_back(wh);
+            std::atomic_store(&workers_, std::shared_ptr<const workers_vec_t>(std::move(workers)));
+        }
+        wh->start();
+    }
+
+    // Tasks left in the queues of removed worker are moved to the shared queues
+    void FinishRemoval(WorkerHelper& wh) {
+        wh.join();
+        RemoveIdle(&wh);
+        class_queues_t<Task> tasks;
+        {
+            std::lock_guard<std::mutex> lock(wh.mux);
+            wh.removed_ = true;
+            tasks = std::move(wh.tasks);
+        }
+        {
+            std::lock_guard<std::mutex> lock(shared_queues_.mux);
+            for (std::size_t task_class = 0; task_class < kNumTaskClasses; ++task_class) {
+                for (auto& queued : tasks[task_class]) {
+                    shared_queues_.tasks[task_class].push_back(std::move(queued));
+                }
+            }
+        }
+        WakeIdle();
+    }
+
+    inline void PushIdle(std::shared_ptr<WorkerHelper> wh) {
+        std::lock_guard<std::mutex> lock(idle_mutex_);
+        if (!wh->idle_) {
+            wh->idle_ = true;
+            idle_workers_.push_back(std::move(wh));
+        }
+    }
+
+    // Returns true if the worker was idle
+    inline bool RemoveIdle(WorkerHelper* wh) {
+        std::lock_guard<std::mutex> lock(idle_mutex_);
+        if (!wh->idle_) {
+            return false;
+        }
+        wh->idle_ = false;
+        idle_workers_.erase(std::find_if(idle_workers_.begin(), idle_workers_.end(),
+                                         [wh](const std::shared_ptr<WorkerHelper>& idle_wh) {
+                                             return idle_wh.get() == wh;
+                                         }));
+        return true;
+    }
+
+    // Idle worker is taken out of the idle list, so the next task goes to another one
+    inline std::shared_ptr<WorkerHelper> PopIdle() {
+        std::lock_guard<std::mutex> lock(idle_mutex_);
+        if (idle_workers_.empty()) {
+            return nullptr;
+        }
+        std::shared_ptr<WorkerHelper> wh = std::move(idle_workers_.back());
+        idle_workers_.pop_back();
+        wh->idle_ = false;
+        return wh;
+    }
+
+    inline void WakeIdle() {
+        if (auto wh = PopIdle()) {
+            wh->Wake();
+        }
+    }
+
+    inline bool TryStartRun(std::size_t task_class) noexcept {
+        ClassState& state = classes_[task_class];
+        const std::size_t max_running = state.max_running;
+        if (max_running == 0) {
+            ++state.running;
+            return true;
+        }
+        std::size_t running = state.running;
+        while (running < max_running) {
+            if (state.running.compare_exchange_weak(running, running + 1)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    inline void FinishRun(std::size_t task_class, clock_t::duration service_time) {
+        ClassState& state = classes_[task_class];
+        --state.running;
+        const std::int64_t sample_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(service_time).count();
+        std::int64_t avg_ns = state.service_time_ns;
+        while (!state.service_time_ns.compare_exchange_weak(avg_ns,
+                                                             avg_ns ? avg_ns + (sample_ns - avg_ns) / 8 : sample_ns)) {}
+        // Worker waiting for a free slot of the class could be sleeping
+        if (state.max_running && state.queued) {
+            WakeIdle();
+        }
+    }
+
+    inline void CountAffinity(WorkerHelper& wh, std::size_t affinity_key) noexcept {
+        if (affinity_key == 0) {
+            return;
+        }
+        if (wh.affinity_key_ == affinity_key) {
+            ++affinity_hits_;
+        } else {
+            ++affinity_misses_;
+            wh.affinity_key_ = affinity_key;
+        }
+    }
+
+    // If max_wait is set, only task which waited longer is taken
+    bool PopTask(TaskQueues& queues, std::size_t task_class, Queued<Task>& queued,
+                 clock_t::duration max_wait = clock_t::duration::zero()) {
+        std::lock_guard<std::mutex> lock(queues.mux);
+        auto& tasks = queues.tasks[task_class];
+        if (tasks.empty()) {
+            return false;
+        }
+        if (max_wait != clock_t::duration::zero() && clock_t::now() - tasks.front().enqueue_time <= max_wait) {
+            return false;
         }
-        if (found) {
-            WorkerHelper& wh = wh_to_remove.front();
-            wh.stop();
-            wake_all();
-            wh.join();
+        queued = std::move(tasks.front());
+        tasks.pop_front();
+        --classes_[task_class].queued;
+        return true;
+    }
+
+    // Own queue is checked first, then the other workers in turn and the shared queue
+    bool StealTask(WorkerHelper& wh, const workers_vec_t& workers, std::size_t task_class, Queued<Task>& queued,
+                   clock_t::duration max_wait = clock_t::duration::zero()) {
+        if (PopTask(wh, task_class, queued, max_wait)) {
             return true;
         }
+        const std::size_t num_workers = workers.size();
+        for (std::size_t i = 0; i < num_workers; ++i) {
+            WorkerHelper& victim = *workers[(wh.steal_offset_ + i) % num_workers];
+            if (&victim != &wh && PopTask(victim, task_class, queued, max_wait)) {
+                wh.steal_offset_ += i;
+                return true;
+            }
+        }
+        return PopTask(shared_queues_, task_class, queued, max_wait);
+    }
+
+    bool TakeWork(WorkerHelper& wh, Queued<Task>& queued, std::size_t& task_class) {
+        auto workers = std::atomic_load(&workers_);
+        // Starvation protection: tasks which waited too long go first
+        for (task_class = 1; task_class < kNumTaskClasses; ++task_class) {
+            const std::chrono::milliseconds max_wait(classes_[task_class].max_wait_ms.load());
+            if (max_wait.count() == 0 || classes_[task_class].queued == 0 || !TryStartRun(task_class)) {
+                continue;
+            }
+            if (StealTask(wh, *workers, task_class, queued, max_wait)) {
+                return true;
+            }
+            --classes_[task_class].running;
+        }
+        for (task_class = 0; task_class < kNumTaskClasses; ++task_class) {
+            if (classes_[task_class].queued == 0 || !TryStartRun(task_class)) {
+                continue;
+            }
+            if (StealTask(wh, *workers, task_class, queued)) {
+                return true;
+            }
+            --classes_[task_class].running;
+        }
+        return false;
+    }
+
+    bool HasWork() const {
+        for (const ClassState& state : classes_) {
+            if (state.queued && (state.max_running == 0 || state.running < state.max_running)) {
+                return true;
+            }
+        }
         return false;
     }
 
+    // Should be called under queues.mux
+    inline void PushTask(TaskQueues& queues, std::size_t task_class, Task&& task, std::size_t affinity_key = 0) {
+        queues.tasks[task_class].push_back({std::move(task), clock_t::now(), affinity_key});
+        ++classes_[task_class].queued;
+    }
 
-private:
-    inline void wake_one() noexcept {
-        cv_.notify_one();
+    // Worker which processed the last task with the key
+    std::shared_ptr<WorkerHelper> FindAffineWorker(std::size_t affinity_key) const {
+        if (affinity_key == 0 || affinity_queue_depth_ == 0) {
+            return nullptr;
+        }
+        auto workers = std::atomic_load(&workers_);
+        for (auto& wh : *workers) {
+            if (wh->affinity_key_ == affinity_key) {
+                return wh;
+            }
+        }
+        return nullptr;
     }
 
-    inline void wake_all() noexcept {
-        cv_.notify_all();
+    // Task is moved only if it is pushed. Zero max_depth means no limit.
+    bool PushToWorker(WorkerHelper& wh, std::size_t task_class, Task& task, std::size_t affinity_key,
+                      std::size_t max_depth = 0) {
+        std::lock_guard<std::mutex> lock(wh.mux);
+        if (wh.removed_ || (max_depth && wh.num_tasks() >= max_depth)) {
+            return false;
+        }
+        PushTask(wh, task_class, std::move(task), affinity_key);
+        wh.woken_ = true;
+        wh.cv_.notify_one();
+        return true;
     }
 
     template <typename T>
-    void PostTaskImpl(T&& task) {
-        std::lock_guard<std::mutex> lock(queue_mutex_);
-        if (queue_limit_ && tasks_.size() >= queue_limit_) {
-            tasks_.pop_front();
+    void PostTaskImpl(T&& task, TaskClass task_class, std::size_t affinity_key) {
+        const std::size_t class_idx = static_cast<std::size_t>(task_class);
+        const std::size_t class_queue_limit = classes_[class_idx].queue_limit;
+        const std::size_t queue_limit = queue_limit_;
+        if (class_queue_limit && classes_[class_idx].queued >= class_queue_limit) {
+            Drop(class_idx);
+        } else if (queue_limit && NumQueued() >= queue_limit) {
+            // Shed the lowest class first
+            bool dropped = false;
+            for (std::size_t i = kNumTaskClasses; !dropped && i-- > class_idx;) {
+                dropped = Drop(i);
+            }
+            if (!dropped) {
+                // All queued tasks are more important than the new one
+                OnDrop(Task(std::forward<T>(task)));
+                return;
+            }
+        }
+
+        Task new_task(std::forward<T>(task));
+        // Affine worker is taken at once only if it is idle, waiting behind its current task is worse than cold
+        // caches of another idle worker
+        std::shared_ptr<WorkerHelper> affine_wh = FindAffineWorker(affinity_key);
+        if (affine_wh && RemoveIdle(affine_wh.get()) && PushToWorker(*affine_wh, class_idx, new_task, affinity_key)) {
+            return;
+        }
+        while (auto idle_wh = PopIdle()) {
+            if (PushToWorker(*idle_wh, class_idx, new_task, affinity_key)) {
+                return;
+            }
+        }
+        // All workers are busy, the affine one is preferred unless its queue is deep
+        if (affine_wh && PushToWorker(*affine_wh, class_idx, new_task, affinity_key, affinity_queue_depth_)) {
+            WakeIdle();
+            return;
+        }
+        auto workers = std::atomic_load(&workers_);
+        if (!workers->empty()) {
+            // All workers are busy, one of them or a thief will get the task. The worker could have gone to sleep
+            // since no idle worker was found, so it is woken as well as any worker which became idle meanwhile.
+            WorkerHelper& wh = *(*workers)[next_worker_++ % workers->size()];
+            bool pushed = false;
+            {
+                std::lock_guard<std::mutex> lock(wh.mux);
+                if (!wh.removed_) {
+                    PushTask(wh, class_idx, std::move(new_task), affinity_key);
+                    wh.woken_ = true;
+                    wh.cv_.notify_one();
+                    pushed = true;
+                }
+            }
+            if (pushed) {
+                WakeIdle();
+                return;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(shared_queues_.mux);
+            PushTask(shared_queues_, class_idx, std::move(new_task), affinity_key);
+        }
+        WakeIdle();
+    }
+
+    // Drops the oldest task of the class among all queues
+    bool Drop(std::size_t task_class) {
+        auto workers = std::atomic_load(&workers_);
+        TaskQueues* oldest_queues = nullptr;
+        clock_t::time_point oldest_time;
+        auto check_queues = [&](TaskQueues& queues) {
+            std::lock_guard<std::mutex> lock(queues.mux);
+            const auto& tasks = queues.tasks[task_class];
+            if (!tasks.empty() && (!oldest_queues || tasks.front().enqueue_time < oldest_time)) {
+                oldest_queues = &queues;
+                oldest_time = tasks.front().enqueue_time;
+            }
+        };
+        for (auto& wh : *workers) {
+            check_queues(*wh);
+        }
+        check_queues(shared_queues_);
+        Queued<Task> queued;
+        if (!oldest_queues || !PopTask(*oldest_queues, task_class, queued)) {
+            return false;
+        }
+        OnDrop(std::move(queued.item));
+        return true;
+    }
+
+    void OnDrop(Task&& task) {
+        drop_handler_t drop_handler;
+        {
+            std::lock_guard<std::mutex> lock(drop_handler_mutex_);
+            drop_handler = drop_handler_;
+        }
+        if (drop_handler) {
+            drop_handler(std::move(task));
+        }
+    }
+
+    inline std::size_t NumQueued() const noexcept {
+        std::size_t num_queued = 0;
+        for (const ClassState& state : classes_) {
+            num_queued += state.queued;
         }
-        tasks_.push_back(std::forward<T>(task));
-        wake_one();
+        return num_queued;
     }
 
-    std::deque<Task> tasks_;
-    std::list<WorkerHelper> workers_;
+    // Copy on write, so posting and stealing never wait for workers_mutex_
+    std::shared_ptr<const workers_vec_t> workers_;
     mutable std::mutex workers_mutex_;
-    mutable std::mutex queue_mutex_;
-    mutable std::condition_variable cv_;
-    std::size_t queue_limit_;
+    std::vector<std::shared_ptr<WorkerHelper>> idle_workers_;
+    std::mutex idle_mutex_;
+    // Tasks which have no worker to go to
+    TaskQueues shared_queues_;
+    std::array<ClassState, kNumTaskClasses> classes_;
+    std::atomic<std::size_t> next_worker_{0};
+    std::atomic<std::size_t> queue_limit_;
+    std::atomic<std::size_t> affinity_queue_depth_{1};
+    std::atomic<std::uint64_t> affinity_hits_{0};
+    std::atomic<std::uint64_t> affinity_misses_{0};
+    drop_handler_t drop_handler_;
+    std::mutex drop_handler_mutex_;
 };
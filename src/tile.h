@@ -1,6 +1,8 @@
 #pragma once
 
 #include <cmath>
+#include <experimental/string_view>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -112,9 +114,44 @@ inline bool operator!=(const MetatileId& x, const MetatileId& y) {
 std::ostream& operator<<(std::ostream& os, const MetatileId& metatile_id);
 
 
+// Tile bytes are either owned in data or shared with other tiles. Shared bytes are a view into a buffer kept
+// alive by owner, e.g. a decompressed data tile or a mapped archive, so copies of the tile do not copy them.
 struct Tile {
+    Tile() = default;
+
+    Tile(const TileId& _id, std::string _data) : id(_id), data(std::move(_data)) {}
+
+    Tile(const TileId& _id, std::shared_ptr<const std::string> buffer) : id(_id), view(*buffer), owner(buffer) {}
+
+    // View into a mapped file which the owner keeps mapped
+    Tile(const TileId& _id, std::experimental::string_view _view, std::shared_ptr<const void> _owner) :
+            id(_id), view(_view), owner(std::move(_owner)), mapped(true) {}
+
+    inline std::experimental::string_view bytes() const noexcept {
+        return owner ? view : std::experimental::string_view(data);
+    }
+
+    // Owned bytes are moved out, shared bytes are copied
+    inline std::string TakeBytes() {
+        return owner ? view.to_string() : std::move(data);
+    }
+
+    // Moves owned bytes into a shared buffer
+    inline void Share() {
+        if (!owner) {
+            auto buffer = std::make_shared<const std::string>(std::move(data));
+            data.clear();
+            view = *buffer;
+            owner = std::move(buffer);
+        }
+    }
+
     TileId id;
     std::string data;
+    std::experimental::string_view view;
+    std::shared_ptr<const void> owner;
+    // Bytes are in a mapped file, not on the heap
+    bool mapped{false};
 };
 
 struct Metatile {
@@ -0,0 +1,93 @@
+#include "tile_archive.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+
+static inline std::int64_t ModificationTimeNs(const struct stat& file_stat) {
+    return std::int64_t(file_stat.st_mtim.tv_sec) * 1000000000 + file_stat.st_mtim.tv_nsec;
+}
+
+TileArchive::TileArchive(const char* data, std::size_t size) : data_(data), size_(size) {}
+
+TileArchive::~TileArchive() {
+    munmap(const_cast<char*>(data_), size_);
+}
+
+std::shared_ptr<const TileArchive> TileArchive::Open(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            LOG(ERROR) << "Unable to open tile archive " << path << ": " << std::strerror(errno);
+        }
+        return nullptr;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || static_cast<std::size_t>(file_stat.st_size) < sizeof(TileArchiveHeader)) {
+        LOG(ERROR) << "Invalid tile archive " << path;
+        close(fd);
+        return nullptr;
+    }
+    const std::size_t size = static_cast<std::size_t>(file_stat.st_size);
+    void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        LOG(ERROR) << "Unable to map tile archive " << path << ": " << std::strerror(errno);
+        return nullptr;
+    }
+    // Tiles are requested in no particular order
+    madvise(data, size, MADV_RANDOM);
+    std::shared_ptr<TileArchive> archive(new TileArchive(static_cast<const char*>(data), size));
+    archive->device_ = file_stat.st_dev;
+    archive->inode_ = file_stat.st_ino;
+    archive->mtime_ns_ = ModificationTimeNs(file_stat);
+
+    TileArchiveHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, kTileArchiveMagic, sizeof(header.magic)) != 0 ||
+            header.directory_offset % alignof(TileArchiveEntry) != 0 ||
+            header.directory_offset > size ||
+            header.num_tiles > (size - header.directory_offset) / sizeof(TileArchiveEntry)) {
+        LOG(ERROR) << "Invalid tile archive " << path;
+        return nullptr;
+    }
+    archive->directory_ = reinterpret_cast<const TileArchiveEntry*>(archive->data_ + header.directory_offset);
+    archive->num_tiles_ = header.num_tiles;
+    return archive;
+}
+
+bool TileArchive::Replaced(const std::string& path) const {
+    struct stat file_stat;
+    if (stat(path.c_str(), &file_stat) != 0) {
+        return true;
+    }
+    return file_stat.st_dev != device_ || file_stat.st_ino != inode_ ||
+           static_cast<std::size_t>(file_stat.st_size) != size_ || ModificationTimeNs(file_stat) != mtime_ns_;
+}
+
+bool TileArchive::Find(const TileId& tile_id, std::experimental::string_view& blob) const noexcept {
+    if (tile_id.z > kTileArchiveMaxZoom) {
+        return false;
+    }
+    const std::uint64_t key = TileArchiveKey(tile_id);
+    const TileArchiveEntry* end = directory_ + num_tiles_;
+    const TileArchiveEntry* entry = std::lower_bound(directory_, end, key,
+            [](const TileArchiveEntry& e, std::uint64_t k) { return e.key < k; });
+    if (entry == end || entry->key != key) {
+        return false;
+    }
+    // Broken entries are treated as missing tiles
+    if (entry->offset > size_ || entry->size > size_ - entry->offset) {
+        return false;
+    }
+    blob = std::experimental::string_view(data_ + entry->offset, entry->size);
+    return true;
+}
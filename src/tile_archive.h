@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <experimental/string_view>
+#include <memory>
+#include <string>
+
+#include "tile.h"
+
+
+// Archive of the tiles of one data version packed into a single file:
+//   header | tile blobs | directory
+// Directory entries are sorted by key and blobs are laid out in the same order, so tiles close to each other are
+// close in the file. Integers are stored in little endian.
+struct TileArchiveHeader {
+    char magic[8];
+    std::uint64_t num_tiles;
+    std::uint64_t directory_offset;
+};
+
+struct TileArchiveEntry {
+    std::uint64_t key;
+    std::uint64_t offset;
+    std::uint32_t size;
+    std::uint32_t reserved;
+};
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "Tile archives are mapped as is on little endian hosts");
+static_assert(sizeof(TileArchiveHeader) == 24 && sizeof(TileArchiveEntry) == 24, "Unexpected archive layout");
+
+constexpr char kTileArchiveMagic[8] = {'M', 'V', 'T', 'A', 'R', 'C', 'H', '1'};
+constexpr uint kTileArchiveMaxZoom = 29;
+
+// Zoom in the high bits and Morton code of the coordinates in the rest, tiles of a zoom are ordered along Z curve
+inline std::uint64_t TileArchiveKey(const TileId& tile_id) noexcept {
+    auto spread_bits = [](std::uint64_t v) {
+        v = (v | (v << 16)) & 0x0000FFFF0000FFFFull;
+        v = (v | (v << 8)) & 0x00FF00FF00FF00FFull;
+        v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0Full;
+        v = (v | (v << 2)) & 0x3333333333333333ull;
+        v = (v | (v << 1)) & 0x5555555555555555ull;
+        return v;
+    };
+    return (std::uint64_t(tile_id.z) << 58) | spread_bits(tile_id.x) | (spread_bits(tile_id.y) << 1);
+}
+
+
+// Read only mapping of an archive file. Lookups do not make system calls.
+class TileArchive {
+public:
+    // Returns nullptr if the file is not a valid archive
+    static std::shared_ptr<const TileArchive> Open(const std::string& path);
+
+    ~TileArchive();
+
+    TileArchive(const TileArchive&) = delete;
+    TileArchive& operator=(const TileArchive&) = delete;
+
+    // Returns false if the archive has no such tile. Blob stays valid while the archive is alive.
+    bool Find(const TileId& tile_id, std::experimental::string_view& blob) const noexcept;
+
+    inline std::size_t num_tiles() const noexcept {
+        return num_tiles_;
+    }
+
+    // Returns true if the file at the path is not the mapped one anymore, e.g. it was replaced or removed
+    bool Replaced(const std::string& path) const;
+
+private:
+    TileArchive(const char* data, std::size_t size);
+
+    const char* data_;
+    std::size_t size_;
+    // Identify the mapped file
+    std::uint64_t device_{0};
+    std::uint64_t inode_{0};
+    std::int64_t mtime_ns_{0};
+    const TileArchiveEntry* directory_{nullptr};
+    std::size_t num_tiles_{0};
+};
@@ -0,0 +1,108 @@
+#include "tile_filter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+
+#include <glog/logging.h>
+
+
+// File layout: header followed by the filter words in little endian
+struct TileFilterHeader {
+    char magic[8];
+    std::uint32_t num_hashes;
+    std::uint32_t reserved;
+    std::uint64_t num_bits;
+};
+
+static const char kTileFilterMagic[8] = {'M', 'V', 'T', 'B', 'L', 'O', 'O', 'M'};
+
+static inline std::uint64_t Mix(std::uint64_t value) noexcept {
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9ull;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111ebull;
+    value ^= value >> 31;
+    return value;
+}
+
+// Bit positions are derived from two hashes of the tile
+template <typename Fn>
+static inline void ForEachBit(const TileId& tile_id, std::uint32_t num_hashes, std::uint64_t num_bits, Fn fn) {
+    const std::uint64_t key = (std::uint64_t(tile_id.z) << 58) ^ (std::uint64_t(tile_id.x) << 29) ^ tile_id.y;
+    const std::uint64_t h1 = Mix(key);
+    const std::uint64_t h2 = Mix(key ^ 0x9e3779b97f4a7c15ull) | 1;
+    for (std::uint32_t i = 0; i < num_hashes; ++i) {
+        if (!fn((h1 + i * h2) % num_bits)) {
+            return;
+        }
+    }
+}
+
+TileFilter::TileFilter(std::size_t num_tiles, double false_positive_rate) {
+    const double ln2 = std::log(2.0);
+    const double rate = std::min(std::max(false_positive_rate, 1e-9), 0.5);
+    const double bits = -double(std::max<std::size_t>(num_tiles, 1)) * std::log(rate) / (ln2 * ln2);
+    num_bits_ = std::max<std::uint64_t>(static_cast<std::uint64_t>(std::ceil(bits / 64)) * 64, 64);
+    num_hashes_ = static_cast<std::uint32_t>(std::max(1.0, std::round(bits / std::max<std::size_t>(num_tiles, 1) * ln2)));
+    words_.assign(num_bits_ / 64, 0);
+}
+
+std::shared_ptr<const TileFilter> TileFilter::Load(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    TileFilterHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+            std::memcmp(header.magic, kTileFilterMagic, sizeof(header.magic)) != 0 ||
+            header.num_hashes == 0 || header.num_bits == 0 || header.num_bits % 64 != 0) {
+        LOG(ERROR) << "Invalid tile filter " << path;
+        return nullptr;
+    }
+    // Size in the header is checked against the file, so a corrupted one does not cause a huge allocation
+    const std::streamoff data_offset = file.tellg();
+    file.seekg(0, std::ios::end);
+    const std::streamoff file_size = file.tellg();
+    if (file_size < 0 || static_cast<std::uint64_t>(file_size - data_offset) != header.num_bits / 8) {
+        LOG(ERROR) << "Tile filter " << path << " size does not match its header";
+        return nullptr;
+    }
+    file.seekg(data_offset);
+    std::shared_ptr<TileFilter> filter(new TileFilter());
+    filter->num_bits_ = header.num_bits;
+    filter->num_hashes_ = header.num_hashes;
+    filter->words_.resize(header.num_bits / 64);
+    if (!file.read(reinterpret_cast<char*>(filter->words_.data()), filter->words_.size() * sizeof(std::uint64_t))) {
+        LOG(ERROR) << "Truncated tile filter " << path;
+        return nullptr;
+    }
+    return filter;
+}
+
+bool TileFilter::Save(const std::string& path) const {
+    TileFilterHeader header;
+    std::memcpy(header.magic, kTileFilterMagic, sizeof(header.magic));
+    header.num_hashes = num_hashes_;
+    header.reserved = 0;
+    header.num_bits = num_bits_;
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(words_.data()), words_.size() * sizeof(std::uint64_t));
+    file.close();
+    return static_cast<bool>(file);
+}
+
+void TileFilter::Add(const TileId& tile_id) noexcept {
+    ForEachBit(tile_id, num_hashes_, num_bits_, [this](std::uint64_t bit) {
+        words_[bit / 64] |= std::uint64_t(1) << (bit % 64);
+        return true;
+    });
+}
+
+bool TileFilter::MayContain(const TileId& tile_id) const noexcept {
+    bool contains = true;
+    ForEachBit(tile_id, num_hashes_, num_bits_, [this, &contains](std::uint64_t bit) {
+        contains = (words_[bit / 64] >> (bit % 64)) & 1;
+        return contains;
+    });
+    return contains;
+}
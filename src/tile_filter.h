@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tile.h"
+
+
+// Bloom filter of the tiles which exist in a data version. Tiles not in the filter surely do not exist, false
+// positives only cost a load. Filters are built offline by tools/tile_filter.
+class TileFilter {
+public:
+    // Filter sized for num_tiles tiles with the given false positive rate
+    TileFilter(std::size_t num_tiles, double false_positive_rate);
+
+    // Returns nullptr if the file is not a valid filter
+    static std::shared_ptr<const TileFilter> Load(const std::string& path);
+
+    bool Save(const std::string& path) const;
+
+    void Add(const TileId& tile_id) noexcept;
+
+    bool MayContain(const TileId& tile_id) const noexcept;
+
+private:
+    TileFilter() = default;
+
+    std::uint64_t num_bits_{0};
+    std::uint32_t num_hashes_{0};
+    std::vector<std::uint64_t> words_;
+};
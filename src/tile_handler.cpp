@@ -1,5 +1,6 @@
 #include "tile_handler.h"
 
+#include <algorithm>
 #include <fstream>
 #include <cctype>
 
@@ -20,6 +21,9 @@ using std::experimental::nullopt;
 using HTTPMessage = proxygen::HTTPMessage;
 using HTTPMethod = proxygen::HTTPMethod;
 
+static const std::chrono::seconds kRenderTimeout(20);
+static const std::chrono::seconds kSubtileTimeout(5);
+
 static std::string MakeCacherKey(const TileId& id, const std::string& info_str) {
     std::string key;
     key.append(std::to_string(id.x));
@@ -188,12 +192,16 @@ void TileHandler::onRequest(std::unique_ptr<HTTPMessage> headers) noexcept {
         }
     }
 
-    if (cacher_ && endpoint_params_->type != EndpointType::static_files) {
+    // Metatile is needed for render coalescing even without cacher
+    if ((cacher_ && endpoint_params_->type != EndpointType::static_files) ||
+            endpoint_params_->type == EndpointType::render) {
         metatile_id_ = GetMetatileId();
         if (!metatile_id_) {
             SendError(500);
             return;
         }
+    }
+    if (cacher_ && endpoint_params_->type != EndpointType::static_files) {
         request_info_ = MakeRequestInfoStr(tags_, ext_, data_version_, layers_.get(),
                                            metatile_id_->width(), metatile_id_->height());
         // We do not cache static files
@@ -318,7 +326,7 @@ void TileHandler::LoadTile() noexcept {
 void TileHandler::OnLoadSuccess(Tile&& tile) noexcept {
     CancelTaskTimeout();
     if (endpoint_params_->type == EndpointType::static_files) {
-        OnProcessingSuccess(std::move(tile.data));
+        OnProcessingSuccess(tile.TakeBytes());
         return;
     }
 
@@ -346,11 +354,52 @@ void TileHandler::ProcessRender() noexcept {
     render_request->metatile_id = *metatile_id_;
     render_request->style_name = endpoint_params_->style_name;
     render_request->data_tile = std::move(data_tile_);
+    render_request->data_provider = endpoint_params_->provider_name;
+    render_request->data_version = data_version_;
     render_request->retina = tags_.find("retina") != tags_.end();
+    std::shared_ptr<RenderTask> rest_task;
+    if (endpoint_params_->requested_tile_first && metatile_id_->width() * metatile_id_->height() > 1) {
+        render_request->requested_tile_first = true;
+        // Without cacher the rest of the metatile is not needed at all
+        if (save_to_cache_ && cacher_) {
+            rest_task = MakeCacheRestTask();
+        }
+    }
     auto render_task = rm_.Render(std::move(render_request),
                                    std::bind(&TileHandler::OnRenderingSuccess, this, std::placeholders::_1),
-                                   std::bind(&TileHandler::OnProcessingError, this));
-    ScheduleTaskTimeout(std::move(render_task), std::chrono::seconds(20));
+                                   std::bind(&TileHandler::OnProcessingError, this, std::placeholders::_1),
+                                   std::move(rest_task),
+                                   std::chrono::steady_clock::now() + kRenderTimeout);
+    ScheduleTaskTimeout(std::move(render_task), kRenderTimeout);
+}
+
+std::shared_ptr<RenderTask> TileHandler::MakeCacheRestTask() {
+    // Rest of the metatile arrives after the response was sent, so the handler must not be captured
+    TileCacher* cacher = cacher_;
+    TileId tile_id = tile_id_;
+    std::string request_info = request_info_;
+    // Rest task sets or unlocks the keys of the rest of the metatile, the handler keeps only its own one
+    std::vector<std::string> rest_keys;
+    const std::string tile_key = MakeCacherKey(tile_id_, request_info_);
+    for (std::string& key : locked_cache_keys_) {
+        if (key != tile_key) {
+            rest_keys.push_back(std::move(key));
+        }
+    }
+    locked_cache_keys_.assign(1, tile_key);
+    return std::make_shared<RenderTask>([cacher, tile_id, request_info](Metatile&& metatile) {
+        for (Tile& tile : metatile.tiles) {
+            // Requested tile is cached by the handler
+            if (tile.id == tile_id) {
+                continue;
+            }
+            auto cached_tile = std::make_shared<CachedTile>(CachedTile{std::move(tile.data)});
+            cacher->Set(MakeCacherKey(tile.id, request_info), cached_tile,
+                        TTLPolicyToSeconds(cached_tile->policy), nullptr);
+        }
+    }, [cacher, rest_keys](RenderError) {
+        cacher->Unlock(rest_keys);
+    });
 }
 
 void TileHandler::ProcessMvt() noexcept {
@@ -360,14 +409,26 @@ void TileHandler::ProcessMvt() noexcept {
 
     auto subtile_task = rm_.MakeSubtile(std::move(subtile_request),
                                         std::bind(&TileHandler::OnRenderingSuccess, this, std::placeholders::_1),
-                                        std::bind(&TileHandler::OnProcessingError, this));
-    ScheduleTaskTimeout(std::move(subtile_task), std::chrono::seconds(5));
+                                        std::bind(&TileHandler::OnProcessingError, this, std::placeholders::_1),
+                                        std::chrono::steady_clock::now() + kSubtileTimeout);
+    ScheduleTaskTimeout(std::move(subtile_task), kSubtileTimeout);
 }
 
 void TileHandler::onBody(std::unique_ptr<folly::IOBuf> body) noexcept {/**/}
 
 void TileHandler::onSuccessEOM() noexcept { }
 
+void TileHandler::requestComplete() noexcept {
+    // Client could have gone before the tile was set to the cache
+    UnlockCache();
+    AsyncTaskHandler::requestComplete();
+}
+
+void TileHandler::onError(proxygen::ProxygenError err) noexcept {
+    UnlockCache();
+    AsyncTaskHandler::onError(err);
+}
+
 void TileHandler::OnRenderingSuccess(Metatile&& metatile) noexcept {
     CancelTaskTimeout();
     Tile* tile_ptr = nullptr;
@@ -381,6 +442,8 @@ void TileHandler::OnRenderingSuccess(Metatile&& metatile) noexcept {
             tile_ptr = &tile;
         }
     }
+    // Set unlocks the keys
+    locked_cache_keys_.clear();
     if (!tile_ptr) {
         LOG(ERROR) << "Requested tile not found in generated metatiles!";
         SendError(500);
@@ -409,14 +472,22 @@ void TileHandler::OnProcessingSuccess(std::string&& tile_data) noexcept {
     rb.sendWithEOM();
 }
 
-void TileHandler::OnProcessingError() noexcept {
+void TileHandler::OnProcessingError(RenderError err) noexcept {
     CancelTaskTimeout();
-    SendError(500);
+    if (err == RenderError::overloaded || err == RenderError::deadline_exceeded) {
+        // Client should come back when the current queue is expected to be drained
+        const auto retry_after = std::chrono::duration_cast<std::chrono::seconds>(
+                    rm_.EstimateRenderDelay() + std::chrono::milliseconds(999));
+        SendError(503, std::max(retry_after, std::chrono::seconds(1)));
+    } else {
+        SendError(500);
+    }
 }
 
 void TileHandler::UnlockCache() noexcept {
     if (cacher_ && !locked_cache_keys_.empty()) {
         cacher_->Unlock(locked_cache_keys_);
+        locked_cache_keys_.clear();
     }
 }
 
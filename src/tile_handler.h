@@ -26,6 +26,8 @@ public:
     void onRequest(std::unique_ptr<proxygen::HTTPMessage> headers) noexcept override;
     void onBody(std::unique_ptr<folly::IOBuf> body) noexcept override;
     void onSuccessEOM() noexcept override;
+    void requestComplete() noexcept override;
+    void onError(proxygen::ProxygenError err) noexcept override;
 
     void OnCachedTileLoaded(std::shared_ptr<CachedTile> tile) noexcept;
     void OnCacherError() noexcept;
@@ -36,7 +38,7 @@ public:
     void OnRenderingSuccess(Metatile&& metatile) noexcept;
 
     void OnProcessingSuccess(std::string&& tile_data) noexcept;
-    void OnProcessingError() noexcept;
+    void OnProcessingError(RenderError err) noexcept;
 
 private:
     using ExtensionType = util::ExtensionType;
@@ -50,6 +52,7 @@ private:
     void GenerateTile() noexcept;
     void LoadTile() noexcept;
     void ProcessRender() noexcept;
+    std::shared_ptr<RenderTask> MakeCacheRestTask();
     void ProcessMvt() noexcept;
     void UnlockCache() noexcept;
 
@@ -59,6 +62,7 @@ private:
     std::shared_ptr<const endpoints_map_t> endpoints_;
     TileCacher* cacher_{nullptr};
 
+    // Keys locked in the cache which the handler has to set or unlock
     std::vector<std::string> locked_cache_keys_;
     TileId tile_id_;
     std::set<std::string> tags_;
@@ -0,0 +1,51 @@
+#include "tile_loader.h"
+
+
+LoadBatch::LoadBatch(std::shared_ptr<LoadManyTask> task, const std::vector<TileId>& tile_ids) :
+        task_(std::move(task)),
+        tiles_(tile_ids.size()),
+        tiles_left_(tile_ids.size()) {
+    for (std::size_t i = 0; i < tile_ids.size(); ++i) {
+        tiles_[i].tile.id = tile_ids[i];
+    }
+    if (tiles_.empty()) {
+        task_->SetResult(std::vector<BatchTile>());
+    }
+}
+
+void LoadBatch::SetTile(std::size_t idx, Tile&& tile) {
+    BatchTile& batch_tile = tiles_[idx];
+    batch_tile.tile = std::move(tile);
+    batch_tile.loaded = true;
+    FinishTile();
+}
+
+void LoadBatch::SetError(std::size_t idx, LoadError error) {
+    tiles_[idx].error = error;
+    FinishTile();
+}
+
+void LoadBatch::FinishTile() {
+    // Tiles are finished on different threads, the last one sees all of them
+    if (tiles_left_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        task_->SetResult(std::move(tiles_));
+    }
+}
+
+std::shared_ptr<LoadTask> LoadBatch::MakeTileTask(std::size_t idx) {
+    auto self = shared_from_this();
+    return std::make_shared<LoadTask>([self, idx](Tile&& tile) {
+        self->SetTile(idx, std::move(tile));
+    }, [self, idx](LoadError error) {
+        self->SetError(idx, error);
+    });
+}
+
+
+void TileLoader::LoadMany(std::shared_ptr<LoadManyTask> task, const std::vector<TileId>& tile_ids,
+                          const std::string& version, LoadPriority priority) {
+    auto batch = std::make_shared<LoadBatch>(std::move(task), tile_ids);
+    for (std::size_t i = 0; i < tile_ids.size(); ++i) {
+        Load(batch->MakeTileTask(i), tile_ids[i], version);
+    }
+}
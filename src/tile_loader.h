@@ -1,7 +1,10 @@
 #pragma once
 
+#include <atomic>
+#include <functional>
 #include <string>
 #include <memory>
+#include <vector>
 
 #include "async_task.h"
 #include "tile.h"
@@ -13,10 +16,85 @@ enum class LoadError {
 
 using LoadTask = AsyncTask<Tile&&, LoadError>;
 
+// Background loads (e.g. prefetch) use only capacity which loads of requested tiles leave idle
+enum class LoadPriority : std::uint8_t {
+    interactive,
+    background
+};
+
+// Tile of a batch load, error is meaningful only if the tile is not loaded
+struct BatchTile {
+    Tile tile;
+    bool loaded{false};
+    LoadError error{LoadError::internal_error};
+};
+
+// Tiles are delivered in the requested order. Error means the whole batch failed.
+using LoadManyTask = AsyncTask<std::vector<BatchTile>&&, LoadError>;
+
+// Collects the tiles of a batch, the batch is delivered when the last tile is done
+class LoadBatch : public std::enable_shared_from_this<LoadBatch> {
+public:
+    LoadBatch(std::shared_ptr<LoadManyTask> task, const std::vector<TileId>& tile_ids);
+
+    LoadBatch(const LoadBatch&) = delete;
+    LoadBatch& operator=(const LoadBatch&) = delete;
+
+    // Every tile has to be finished exactly once
+    void SetTile(std::size_t idx, Tile&& tile);
+    void SetError(std::size_t idx, LoadError error);
+
+    // Task which finishes the tile, so batches can be served by single tile loads
+    std::shared_ptr<LoadTask> MakeTileTask(std::size_t idx);
+
+    inline const TileId& tile_id(std::size_t idx) const noexcept {
+        return tiles_[idx].tile.id;
+    }
+
+    inline std::size_t size() const noexcept {
+        return tiles_.size();
+    }
+
+    inline bool cancelled() const noexcept {
+        return task_->cancelled();
+    }
+
+private:
+    void FinishTile();
+
+    std::shared_ptr<LoadManyTask> task_;
+    std::vector<BatchTile> tiles_;
+    std::atomic<std::size_t> tiles_left_;
+};
+
 class TileLoader {
 public:
+    // Called when data of the version is (re)loaded, so what is known about its tiles is stale. Empty version
+    // means every version, for loaders which serve all of them from the same data.
+    using reload_cb_t = std::function<void(const std::string& version)>;
+
     virtual void Load(std::shared_ptr<LoadTask> task, const TileId& tile_id,
                       const std::string& version = "") = 0;
 
+    // Loads neighbouring tiles at once, so the batch takes about one load latency. Loaders which can not fetch
+    // several tiles natively load them one by one concurrently. Loaders without own workers ignore priority.
+    virtual void LoadMany(std::shared_ptr<LoadManyTask> task, const std::vector<TileId>& tile_ids,
+                          const std::string& version = "", LoadPriority priority = LoadPriority::interactive);
+
     virtual bool HasVersion(const std::string& version) const = 0;
+
+    // Should be called before the loader is used
+    inline void AddReloadCallback(reload_cb_t cb) {
+        reload_cbs_.push_back(std::move(cb));
+    }
+
+protected:
+    inline void NotifyReload(const std::string& version) const {
+        for (const reload_cb_t& cb : reload_cbs_) {
+            cb(version);
+        }
+    }
+
+private:
+    std::vector<reload_cb_t> reload_cbs_;
 };
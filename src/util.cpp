@@ -1,20 +1,148 @@
 #include "util.h"
 
+#include <algorithm>
+#include <stdexcept>
 #include <string>
+#include <tuple>
+#include <utility>
 
-#include <vector_tile_compression.hpp>
+#include <zlib.h>
 
 namespace util {
 
-void decompress(const char *data, size_t data_size, std::string& uncomp) {
-    if (data_size > 2) {
-        if ( (static_cast<uint8_t>(data[0]) == 0x78 && static_cast<uint8_t>(data[1])) ||
-                (static_cast<uint8_t>(data[0]) == 0x1F && static_cast<uint8_t>(data[1])) ) {
-            mapnik::vector_tile_impl::zlib_decompress(data, data_size, uncomp);
-            return;
+static bool is_compressed(const char *data, size_t data_size) {
+    return data_size > 2 &&
+           ((static_cast<uint8_t>(data[0]) == 0x78 && static_cast<uint8_t>(data[1])) ||
+            (static_cast<uint8_t>(data[0]) == 0x1F && static_cast<uint8_t>(data[1])));
+}
+
+// Inflate state and output buffer reused by all decompressions of one thread. Output is sized from the previous
+// tiles, so most tiles are inflated in one pass without reallocations.
+class Inflater {
+public:
+    Inflater() {
+        stream_.zalloc = Z_NULL;
+        stream_.zfree = Z_NULL;
+        stream_.opaque = Z_NULL;
+        stream_.next_in = Z_NULL;
+        stream_.avail_in = 0;
+        // Detect zlib and gzip headers automatically
+        if (inflateInit2(&stream_, 15 + 32) != Z_OK) {
+            throw std::runtime_error("Unable to init inflate stream");
+        }
+    }
+
+    ~Inflater() {
+        inflateEnd(&stream_);
+    }
+
+    Inflater(const Inflater&) = delete;
+    Inflater& operator=(const Inflater&) = delete;
+
+    // Inflates into the thread buffer, the view is valid until the next call
+    std::experimental::string_view Inflate(const char *data, size_t data_size) {
+        const size_t expected_size = ExpectedSize(data_size);
+        // Buffer grown by a single large tile is released
+        if (capacity_ < expected_size || capacity_ > expected_size * 4) {
+            Reallocate(expected_size, 0);
+        }
+        const size_t out_size = InflateInto(data, data_size, buffer_.get(), capacity_, [this](size_t inflated_size) {
+            Reallocate(capacity_ * 2, inflated_size);
+            return std::make_pair(buffer_.get(), capacity_);
+        });
+        return std::experimental::string_view(buffer_.get(), out_size);
+    }
+
+    // Inflates into a string of its own, so it can be shared without copying
+    std::string InflateString(const char *data, size_t data_size) {
+        std::string out(ExpectedSize(data_size), '\0');
+        const size_t out_size = InflateInto(data, data_size, &out[0], out.size(), [&out](size_t) {
+            out.resize(out.size() * 2);
+            return std::make_pair(&out[0], out.size());
+        });
+        out.resize(out_size);
+        // Small tiles would otherwise hold the whole estimate while they are cached
+        if (out.capacity() > out_size + out_size / 4) {
+            out.shrink_to_fit();
+        }
+        return out;
+    }
+
+private:
+    size_t ExpectedSize(size_t data_size) const {
+        static const size_t kMinBufferSize = 64 * 1024;
+        return std::max({kMinBufferSize, data_size * 4, avg_size_ + avg_size_ / 2});
+    }
+
+    // Grow is called with the inflated size when the output is full and returns the grown output and its
+    // capacity, inflated bytes kept
+    template <typename Grow>
+    size_t InflateInto(const char *data, size_t data_size, char *out, size_t capacity, Grow grow) {
+        if (inflateReset(&stream_) != Z_OK) {
+            throw std::runtime_error("Unable to reset inflate stream");
+        }
+        stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        stream_.avail_in = static_cast<uInt>(data_size);
+        size_t out_size = 0;
+        while (true) {
+            stream_.next_out = reinterpret_cast<Bytef*>(out + out_size);
+            stream_.avail_out = static_cast<uInt>(capacity - out_size);
+            const int ret = inflate(&stream_, Z_NO_FLUSH);
+            out_size = capacity - stream_.avail_out;
+            if (ret == Z_STREAM_END) {
+                break;
+            }
+            if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                throw std::runtime_error(stream_.msg ? stream_.msg : "Unable to inflate data");
+            }
+            // Output space is left, so the input is over before the end of the stream
+            if (stream_.avail_out != 0) {
+                throw std::runtime_error("Compressed data is truncated");
+            }
+            std::tie(out, capacity) = grow(out_size);
         }
+        avg_size_ = avg_size_ ? (avg_size_ * 7 + out_size) / 8 : out_size;
+        return out_size;
+    }
+
+    void Reallocate(size_t capacity, size_t keep_size) {
+        std::unique_ptr<char[]> buffer(new char[capacity]);
+        std::copy_n(buffer_.get(), keep_size, buffer.get());
+        buffer_ = std::move(buffer);
+        capacity_ = capacity;
+    }
+
+    z_stream stream_;
+    std::unique_ptr<char[]> buffer_;
+    size_t capacity_{0};
+    // Running average of the inflated sizes
+    size_t avg_size_{0};
+};
+
+static Inflater& thread_inflater() {
+    thread_local Inflater inflater;
+    return inflater;
+}
+
+std::experimental::string_view decompress(const char *data, size_t data_size) {
+    if (!is_compressed(data, data_size)) {
+        return std::experimental::string_view(data, data_size);
+    }
+    return thread_inflater().Inflate(data, data_size);
+}
+
+std::shared_ptr<const std::string> decompress_shared(const char *data, size_t data_size) {
+    if (!is_compressed(data, data_size)) {
+        return std::make_shared<const std::string>(data, data_size);
+    }
+    return std::make_shared<const std::string>(thread_inflater().InflateString(data, data_size));
+}
+
+std::shared_ptr<const std::string> decompress_shared(std::string&& data) {
+    if (!is_compressed(data.data(), data.size())) {
+        return std::make_shared<const std::string>(std::move(data));
     }
-    uncomp.assign(data, data_size);
+    return std::make_shared<const std::string>(thread_inflater().InflateString(data.data(), data.size()));
 }
 
 std::unique_ptr<std::set<std::string>> ParseArray(const std::string& layers) {
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cmath>
+#include <experimental/string_view>
 #include <memory>
 #include <iostream>
 #include <string>
@@ -14,11 +15,16 @@
 
 namespace util {
 
-void decompress(const char *data, size_t data_size, std::string& uncomp);
+// Inflates zlib or gzip data, other data is returned as is without copying. Inflated data is kept in a buffer of
+// the calling thread, so the returned view is invalidated by the next decompress call on this thread and has to
+// be copied or consumed before. Throws std::runtime_error if compressed data is corrupted.
+std::experimental::string_view decompress(const char *data, size_t data_size);
 
-inline void decompress(const std::string data, std::string& uncomp) {
-    decompress(data.data(), data.size(), uncomp);
-}
+// Decompressed data in an immutable buffer which can be shared by tiles. Compressed data is inflated straight into
+// the buffer, uncompressed bytes are copied once.
+std::shared_ptr<const std::string> decompress_shared(const char *data, size_t data_size);
+// Uncompressed data is moved into the buffer
+std::shared_ptr<const std::string> decompress_shared(std::string&& data);
 
 template<typename T, typename ...Args>
 std::unique_ptr<T> make_unique( Args&& ...args )
@@ -0,0 +1,80 @@
+// Builds a filter of existing tiles used by the missing tiles cache of a data provider:
+//   tile_filter [--fp-rate <rate>] <filter> < tiles
+// Tiles are read one per line as z/x/y, e.g. from `find . -name '*.mvt'` in a tiles dir or a dump of a table.
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "tile_filter.h"
+
+
+// Accepts lines like "12/2048/1024" with optional leading dirs and extension, e.g. "./12/2048/1024.mvt"
+static bool ParseTileId(std::string line, TileId& tile_id) {
+    const std::size_t slash_pos = line.rfind('/');
+    const std::size_t dot_pos = line.rfind('.');
+    if (dot_pos != std::string::npos && (slash_pos == std::string::npos || dot_pos > slash_pos)) {
+        line.resize(dot_pos);
+    }
+    std::replace(line.begin(), line.end(), '/', ' ');
+    std::istringstream ss(line);
+    std::vector<std::string> parts;
+    std::string part;
+    while (ss >> part) {
+        parts.push_back(part);
+    }
+    if (parts.size() < 3) {
+        return false;
+    }
+    uint coords[3];
+    for (std::size_t i = 0; i < 3; ++i) {
+        const std::string& number = parts[parts.size() - 3 + i];
+        if (number.find_first_not_of("0123456789") != std::string::npos || number.size() > 9) {
+            return false;
+        }
+        coords[i] = static_cast<uint>(std::stoul(number));
+    }
+    tile_id = TileId(coords[1], coords[2], coords[0]);
+    return tile_id.z < 32 && tile_id.Valid();
+}
+
+int main(int argc, char* argv[]) {
+    double fp_rate = 0.01;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--fp-rate") == 0 && i + 1 < argc) {
+            fp_rate = std::atof(argv[++i]);
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    if (args.size() != 1 || fp_rate <= 0 || fp_rate >= 1) {
+        std::cerr << "Usage: " << argv[0] << " [--fp-rate <rate>] <filter> < tiles" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::vector<TileId> tile_ids;
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        TileId tile_id;
+        if (ParseTileId(line, tile_id)) {
+            tile_ids.push_back(tile_id);
+        } else if (!line.empty()) {
+            std::cerr << "Skipping " << line << std::endl;
+        }
+    }
+    TileFilter filter(tile_ids.size(), fp_rate);
+    for (const TileId& tile_id : tile_ids) {
+        filter.Add(tile_id);
+    }
+    if (!filter.Save(args[0])) {
+        std::cerr << "Unable to write " << args[0] << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "Added " << tile_ids.size() << " tiles to " << args[0] << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,157 @@
+// Packs a tree of z/x/y.mvt files into a tile archive read by ArchiveLoader:
+//   tile_packer [--decompress] <tiles dir> <archive>
+// With --decompress tiles are stored inflated, so the loader returns them without copying.
+
+#include <dirent.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "tile_archive.h"
+#include "util.h"
+
+
+struct TileFile {
+    std::uint64_t key;
+    std::string path;
+};
+
+// Names of the entries which are non negative numbers followed by suffix
+static std::vector<std::pair<uint, std::string>> ListNumbered(const std::string& dir_path,
+                                                              const std::string& suffix = "") {
+    std::vector<std::pair<uint, std::string>> entries;
+    DIR* dir = opendir(dir_path.c_str());
+    if (!dir) {
+        return entries;
+    }
+    while (dirent* entry = readdir(dir)) {
+        const std::string name = entry->d_name;
+        if (name.size() <= suffix.size() || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) {
+            continue;
+        }
+        const std::string number = name.substr(0, name.size() - suffix.size());
+        if (number.find_first_not_of("0123456789") != std::string::npos || number.size() > 9) {
+            continue;
+        }
+        entries.emplace_back(static_cast<uint>(std::stoul(number)), dir_path + "/" + name);
+    }
+    closedir(dir);
+    return entries;
+}
+
+static std::vector<TileFile> CollectTiles(const std::string& tiles_dir) {
+    std::vector<TileFile> tiles;
+    for (const auto& z_entry : ListNumbered(tiles_dir)) {
+        if (z_entry.first > kTileArchiveMaxZoom) {
+            std::cerr << "Skipping zoom " << z_entry.first << std::endl;
+            continue;
+        }
+        const uint max_coord = 1u << z_entry.first;
+        for (const auto& x_entry : ListNumbered(z_entry.second)) {
+            for (const auto& y_entry : ListNumbered(x_entry.second, ".mvt")) {
+                TileId tile_id(x_entry.first, y_entry.first, z_entry.first);
+                if (tile_id.x >= max_coord || tile_id.y >= max_coord) {
+                    std::cerr << "Skipping " << y_entry.second << std::endl;
+                    continue;
+                }
+                tiles.push_back(TileFile{TileArchiveKey(tile_id), y_entry.second});
+            }
+        }
+    }
+    // Blobs are written in the directory order
+    std::sort(tiles.begin(), tiles.end(), [](const TileFile& lhs, const TileFile& rhs) { return lhs.key < rhs.key; });
+    return tiles;
+}
+
+static bool Pack(const std::vector<TileFile>& tiles, const std::string& archive_path, bool decompress) {
+    std::ofstream out(archive_path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        std::cerr << "Unable to create " << archive_path << std::endl;
+        return false;
+    }
+    TileArchiveHeader header;
+    std::memcpy(header.magic, kTileArchiveMagic, sizeof(header.magic));
+    header.num_tiles = tiles.size();
+    header.directory_offset = 0;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    std::vector<TileArchiveEntry> directory;
+    directory.reserve(tiles.size());
+    std::uint64_t offset = sizeof(header);
+    for (const TileFile& tile : tiles) {
+        std::ifstream in(tile.path, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (!in.good() && !in.eof()) {
+            std::cerr << "Unable to read " << tile.path << std::endl;
+            return false;
+        }
+        std::experimental::string_view blob(data);
+        if (decompress) {
+            try {
+                blob = util::decompress(data.data(), data.size());
+            } catch (const std::exception& e) {
+                std::cerr << "Unable to decompress " << tile.path << ": " << e.what() << std::endl;
+                return false;
+            }
+        }
+        if (blob.size() > UINT32_MAX) {
+            std::cerr << "Tile " << tile.path << " is too large" << std::endl;
+            return false;
+        }
+        out.write(blob.data(), blob.size());
+        directory.push_back(TileArchiveEntry{tile.key, offset, static_cast<std::uint32_t>(blob.size()), 0});
+        offset += blob.size();
+    }
+
+    // Directory is mapped as an array of entries
+    const std::uint64_t padding = (alignof(TileArchiveEntry) - offset % alignof(TileArchiveEntry)) %
+                                  alignof(TileArchiveEntry);
+    out.write(std::string(padding, '\0').data(), padding);
+    header.directory_offset = offset + padding;
+    out.write(reinterpret_cast<const char*>(directory.data()), directory.size() * sizeof(TileArchiveEntry));
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.close();
+    if (!out) {
+        std::cerr << "Unable to write " << archive_path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    bool decompress = false;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--decompress") == 0) {
+            decompress = true;
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    if (args.size() != 2) {
+        std::cerr << "Usage: " << argv[0] << " [--decompress] <tiles dir> <archive>" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const std::vector<TileFile> tiles = CollectTiles(args[0]);
+    // Archive appears complete or not at all, loaders may map it at any moment
+    const std::string tmp_path = args[1] + ".tmp";
+    if (!Pack(tiles, tmp_path, decompress)) {
+        std::remove(tmp_path.c_str());
+        return EXIT_FAILURE;
+    }
+    if (std::rename(tmp_path.c_str(), args[1].c_str()) != 0) {
+        std::cerr << "Unable to rename " << tmp_path << " to " << args[1] << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "Packed " << tiles.size() << " tiles into " << args[1] << std::endl;
+    return EXIT_SUCCESS;
+}